@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+enum class LogLevel : int {
+    DEBUG = 0,
+    INFO = 1,
+    WARN = 2,
+    ERROR = 3,
+    OFF = 4
+};
+
+// Logger for the request path. A log call formats into a fixed-size slot of a
+// per-thread single-producer ring and returns; a background thread drains all rings
+// and writes whole batches to stdout (stderr for WARN and ERROR). When a ring is
+// full the message is dropped and counted instead of blocking the caller.
+// Lines look like "2026-01-01T12:00:00.123Z INFO <message>".
+class AsyncLogger {
+public:
+    static constexpr size_t RECORD_SIZE = 512;
+    static constexpr size_t RING_CAPACITY = 256;
+
+    // Never destroyed, so threads still running during exit can log safely;
+    // an atexit hook writes out whatever is still buffered
+    static AsyncLogger& instance() {
+        static AsyncLogger* logger = [] {
+            AsyncLogger* created = new AsyncLogger();
+            std::atexit([] { instance().shutdown(); });
+            return created;
+        }();
+        return *logger;
+    }
+
+    static LogLevel level_from_string(const std::string& name) {
+        if (name == "debug" || name == "DEBUG") return LogLevel::DEBUG;
+        if (name == "warn" || name == "WARN" || name == "warning" || name == "WARNING") return LogLevel::WARN;
+        if (name == "error" || name == "ERROR") return LogLevel::ERROR;
+        if (name == "off" || name == "OFF" || name == "none" || name == "NONE") return LogLevel::OFF;
+        return LogLevel::INFO;
+    }
+
+    // sample_rate: log every n-th message of LOG_SAMPLED call sites (per thread),
+    // body_max: bytes of request/response bodies shown by body_preview()
+    void configure(LogLevel level, unsigned sample_rate, size_t body_max) {
+        min_level().store(static_cast<int>(level), std::memory_order_relaxed);
+        sample_every.store(sample_rate ? sample_rate : 1, std::memory_order_relaxed);
+        body_limit.store(body_max, std::memory_order_relaxed);
+    }
+
+    static bool enabled(LogLevel level) {
+        return static_cast<int>(level) >= min_level().load(std::memory_order_relaxed);
+    }
+
+    bool sample(uint32_t& counter) {
+        unsigned rate = sample_every.load(std::memory_order_relaxed);
+        return rate <= 1 || counter++ % rate == 0;
+    }
+
+    // Length to pass to "%.*s" for a body of len bytes
+    int body_preview(size_t len) const {
+        return static_cast<int>(std::min(len, body_limit.load(std::memory_order_relaxed)));
+    }
+
+    void log(LogLevel level, const char* format, ...) __attribute__((format(printf, 3, 4))) {
+        Ring& ring = local_ring();
+        size_t head = ring.head.load(std::memory_order_relaxed);
+        if (head - ring.tail.load(std::memory_order_acquire) == RING_CAPACITY) {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        Record& record = ring.records[head % RING_CAPACITY];
+        record.time = std::chrono::system_clock::now();
+        record.level = level;
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(record.text, RECORD_SIZE, format, args);
+        va_end(args);
+        record.length = written < 0 ? 0 : std::min<size_t>(written, RECORD_SIZE - 1);
+
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Stops the writer thread and writes out all buffered messages
+    void shutdown() {
+        running.store(false);
+        if (writer.joinable()) {
+            writer.join();
+        }
+        drain();
+    }
+
+private:
+    struct Record {
+        std::chrono::system_clock::time_point time;
+        LogLevel level;
+        size_t length;
+        char text[RECORD_SIZE];
+    };
+
+    struct Ring {
+        Record records[RING_CAPACITY];
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<bool> orphaned{false};
+    };
+
+    // Marks the ring for removal once the owning thread has exited and it is drained
+    struct RingHolder {
+        std::shared_ptr<Ring> ring;
+        ~RingHolder() {
+            if (ring) {
+                ring->orphaned.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    std::mutex rings_mutex;
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::atomic<unsigned> sample_every{1};
+    std::atomic<size_t> body_limit{256};
+    std::atomic<bool> running{true};
+    std::thread writer;
+    std::string out_buffer;
+    std::string err_buffer;
+
+    AsyncLogger() {
+        writer = std::thread([this] {
+            while (running.load()) {
+                if (drain() == 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                }
+            }
+        });
+    }
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    static std::atomic<int>& min_level() {
+        static std::atomic<int> level{static_cast<int>(LogLevel::INFO)};
+        return level;
+    }
+
+    Ring& local_ring() {
+        thread_local RingHolder holder;
+        if (!holder.ring) {
+            holder.ring = std::make_shared<Ring>();
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            rings.push_back(holder.ring);
+        }
+        return *holder.ring;
+    }
+
+    // Writer thread only (and shutdown() after it has stopped)
+    size_t drain() {
+        std::vector<std::shared_ptr<Ring>> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            snapshot = rings;
+        }
+
+        size_t count = 0;
+        for (const std::shared_ptr<Ring>& ring : snapshot) {
+            bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+            size_t tail = ring->tail.load(std::memory_order_relaxed);
+            size_t head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; tail++) {
+                const Record& record = ring->records[tail % RING_CAPACITY];
+                append_line(record.level >= LogLevel::WARN ? err_buffer : out_buffer,
+                            record.time, record.level, record.text, record.length);
+                count++;
+            }
+            ring->tail.store(tail, std::memory_order_release);
+
+            uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped) {
+                char text[64];
+                int length = snprintf(text, sizeof(text), "dropped %llu log messages", (unsigned long long)dropped);
+                append_line(err_buffer, std::chrono::system_clock::now(), LogLevel::WARN, text, length);
+            }
+
+            if (orphaned) {
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                rings.erase(std::remove(rings.begin(), rings.end(), ring), rings.end());
+            }
+        }
+
+        flush(STDOUT_FILENO, out_buffer);
+        flush(STDERR_FILENO, err_buffer);
+        return count;
+    }
+
+    static void append_line(std::string& buffer, std::chrono::system_clock::time_point time,
+                            LogLevel level, const char* text, size_t length) {
+        static const char* names[] = {"DEBUG", "INFO", "WARN", "ERROR", "OFF"};
+
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+        time_t seconds = static_cast<time_t>(ms / 1000);
+        struct tm utc;
+        gmtime_r(&seconds, &utc);
+
+        char prefix[48];
+        size_t prefix_length = strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &utc);
+        prefix_length += snprintf(prefix + prefix_length, sizeof(prefix) - prefix_length, ".%03dZ %s ",
+                                  static_cast<int>(ms % 1000), names[static_cast<int>(level)]);
+
+        buffer.append(prefix, prefix_length);
+        buffer.append(text, length);
+        buffer += '\n';
+    }
+
+    static void flush(int fd, std::string& buffer) {
+        size_t offset = 0;
+        while (offset < buffer.size()) {
+            ssize_t written = ::write(fd, buffer.data() + offset, buffer.size() - offset);
+            if (written <= 0) {
+                break;
+            }
+            offset += written;
+        }
+        buffer.clear();
+    }
+};
+
+// Arguments are only evaluated when the level is enabled
+#define LOG_AT(level, ...) \
+    do { \
+        if (AsyncLogger::enabled(level)) { \
+            AsyncLogger::instance().log(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LogLevel::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LogLevel::INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogLevel::ERROR, __VA_ARGS__)
+
+// Keeps one in LOG_SAMPLE_RATE messages of this call site, for per-request lines
+#define LOG_SAMPLED(level, ...) \
+    do { \
+        if (AsyncLogger::enabled(level)) { \
+            static thread_local uint32_t log_sample_counter = 0; \
+            if (AsyncLogger::instance().sample(log_sample_counter)) { \
+                AsyncLogger::instance().log(level, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
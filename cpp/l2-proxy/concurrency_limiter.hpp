@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <prometheus/gauge.h>
+
+// Adaptive limit on concurrent calls to one backend (additive increase,
+// multiplicative decrease). A call that completes in time raises the limit by
+// 1/limit, so about +1 per round of calls, but only while the limit is actually
+// being used. An error, or congestion, cuts the limit by backoff.
+// Congestion is a gradient between two moving averages of the latency: the recent
+// one (about the last fifty calls) rising above tolerance x the long-term one
+// (about five hundred). Single slow calls, such as the large requests of a mixed
+// payload, barely move the recent average, whereas queueing at the backend slows
+// every call; the long-term average follows a backend that has become slower for
+// good. Cuts happen at most once per cooldown, at least one recent round trip, so
+// one burst of slow calls is a single congestion signal. The current limit is
+// published to a gauge.
+class AimdLimiter {
+private:
+    static constexpr double BACKOFF = 0.9;
+    static constexpr double TOLERANCE = 2.0;
+    static constexpr double RECENT_WEIGHT = 0.02;
+    static constexpr double LONG_TERM_WEIGHT = 0.002;
+    static constexpr std::chrono::milliseconds MIN_COOLDOWN{10};
+
+    std::atomic<int> in_flight{0};
+    std::atomic<int> current_limit;
+    prometheus::Gauge& limit_gauge;
+
+    std::mutex mutex;
+    double limit;
+    double min_limit;
+    double max_limit;
+    double recent_us = 0;      // moving averages of the latency of successful calls
+    double long_term_us = 0;
+    std::chrono::steady_clock::time_point last_decrease;
+
+    void publish() {
+        current_limit.store(static_cast<int>(limit), std::memory_order_relaxed);
+        limit_gauge.Set(static_cast<int>(limit));
+    }
+
+public:
+    AimdLimiter(int initial, int minimum, int maximum, prometheus::Gauge& gauge)
+        : limit_gauge(gauge), min_limit(std::max(1, minimum)), max_limit(std::max(minimum, maximum)) {
+        limit = std::min(max_limit, std::max(min_limit, static_cast<double>(initial)));
+        publish();
+    }
+
+    // Takes a slot for one call, false if the limit is reached
+    bool try_acquire() {
+        int current = in_flight.load(std::memory_order_relaxed);
+        while (current < current_limit.load(std::memory_order_relaxed)) {
+            if (in_flight.compare_exchange_weak(current, current + 1, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Gives a slot back without a call having been made
+    void cancel() {
+        in_flight.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Gives a slot back and adjusts the limit from how the call went
+    void release(std::chrono::microseconds latency, bool ok) {
+        int still_in_flight = in_flight.fetch_sub(1, std::memory_order_relaxed) - 1;
+        auto now = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ok && long_term_us == 0) {
+            recent_us = long_term_us = latency.count();
+        } else if (ok) {
+            recent_us += RECENT_WEIGHT * (latency.count() - recent_us);
+            long_term_us += LONG_TERM_WEIGHT * (latency.count() - long_term_us);
+        }
+
+        bool congested = !ok || recent_us > long_term_us * TOLERANCE;
+        if (congested) {
+            auto cooldown = std::max<std::chrono::steady_clock::duration>(
+                MIN_COOLDOWN, std::chrono::microseconds((long long)recent_us));
+            if (now - last_decrease >= cooldown) {
+                limit = std::max(min_limit, limit * BACKOFF);
+                last_decrease = now;
+                publish();
+            }
+        } else if (still_in_flight + 1 >= limit / 2) {
+            limit = std::min(max_limit, limit + 1.0 / limit);
+            publish();
+        }
+    }
+
+    int get() const {
+        return current_limit.load(std::memory_order_relaxed);
+    }
+};
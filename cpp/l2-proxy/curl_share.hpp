@@ -0,0 +1,48 @@
+#pragma once
+
+#include <mutex>
+#include <curl/curl.h>
+
+// curl share handle used by the easy handles of all worker threads, so DNS lookups
+// and TLS sessions are cached once per process instead of once per thread.
+// curl calls back into lock()/unlock() around every access to shared data; each
+// kind of data has its own mutex.
+class CurlShare {
+private:
+    CURLSH* share;
+    std::mutex locks[CURL_LOCK_DATA_LAST];
+
+    static void lock(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+        static_cast<CurlShare*>(userptr)->locks[data].lock();
+    }
+
+    static void unlock(CURL*, curl_lock_data data, void* userptr) {
+        static_cast<CurlShare*>(userptr)->locks[data].unlock();
+    }
+
+public:
+    CurlShare() {
+        share = curl_share_init();
+        if (share) {
+            curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+            curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+            curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        }
+    }
+
+    // Every easy handle using the share must be cleaned up first
+    ~CurlShare() {
+        if (share) {
+            curl_share_cleanup(share);
+        }
+    }
+
+    CurlShare(const CurlShare&) = delete;
+    CurlShare& operator=(const CurlShare&) = delete;
+
+    CURLSH* get() const {
+        return share;
+    }
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <cstddef>
+
+// Single-pass JSON syntax check without building a document, used to decide whether
+// a payload can be spliced into another JSON document verbatim. Accepts exactly one
+// value surrounded by optional whitespace; nesting deeper than MAX_DEPTH is rejected.
+class JsonValidator {
+public:
+    static bool valid(const char* data, size_t len) {
+        JsonValidator validator(data, data + len);
+        validator.skip_whitespace();
+        if (!validator.value(0)) {
+            return false;
+        }
+        validator.skip_whitespace();
+        return validator.pos == validator.end;
+    }
+
+private:
+    static constexpr int MAX_DEPTH = 256;
+
+    const char* pos;
+    const char* end;
+
+    JsonValidator(const char* begin, const char* limit) : pos(begin), end(limit) {}
+
+    void skip_whitespace() {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) {
+            pos++;
+        }
+    }
+
+    bool literal(const char* text) {
+        for (; *text; text++, pos++) {
+            if (pos == end || *pos != *text) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static int hex_value(char c) {
+        if (is_digit(c)) {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    // Reads the four hex digits of a \u escape
+    bool code_unit(unsigned& unit) {
+        unit = 0;
+        for (int i = 0; i < 4; i++, pos++) {
+            int digit = pos < end ? hex_value(*pos) : -1;
+            if (digit < 0) {
+                return false;
+            }
+            unit = unit * 16 + digit;
+        }
+        return true;
+    }
+
+    // jsoncpp rejects a high surrogate that is not followed by a low one, which would make
+    // the spliced reply unreadable; only complete pairs pass, a lone surrogate of either
+    // kind sends the payload down the string path
+    bool unicode_escape() {
+        unsigned unit;
+        if (!code_unit(unit)) {
+            return false;
+        }
+        if (unit >= 0xDC00 && unit <= 0xDFFF) {
+            return false;
+        }
+        if (unit < 0xD800 || unit > 0xDBFF) {
+            return true;
+        }
+        if (end - pos < 2 || pos[0] != '\\' || pos[1] != 'u') {
+            return false;
+        }
+        pos += 2;
+        return code_unit(unit) && unit >= 0xDC00 && unit <= 0xDFFF;
+    }
+
+    bool string() {
+        pos++;  // opening quote
+        while (pos < end) {
+            unsigned char c = *pos++;
+            if (c == '"') {
+                return true;
+            }
+            if (c < 0x20) {
+                return false;
+            }
+            if (c == '\\') {
+                if (pos == end) {
+                    return false;
+                }
+                char escape = *pos++;
+                if (escape == 'u') {
+                    if (!unicode_escape()) {
+                        return false;
+                    }
+                } else if (escape != '"' && escape != '\\' && escape != '/' && escape != 'b'
+                           && escape != 'f' && escape != 'n' && escape != 'r' && escape != 't') {
+                    return false;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool digits() {
+        const char* start = pos;
+        while (pos < end && is_digit(*pos)) {
+            pos++;
+        }
+        return pos > start;
+    }
+
+    bool number() {
+        if (*pos == '-') {
+            pos++;
+        }
+        if (pos < end && *pos == '0') {
+            pos++;
+        } else if (!digits()) {
+            return false;
+        }
+        if (pos < end && *pos == '.') {
+            pos++;
+            if (!digits()) {
+                return false;
+            }
+        }
+        if (pos < end && (*pos == 'e' || *pos == 'E')) {
+            pos++;
+            if (pos < end && (*pos == '+' || *pos == '-')) {
+                pos++;
+            }
+            if (!digits()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool object(int depth) {
+        pos++;  // {
+        skip_whitespace();
+        if (pos < end && *pos == '}') {
+            pos++;
+            return true;
+        }
+        while (pos < end) {
+            if (*pos != '"' || !string()) {
+                return false;
+            }
+            skip_whitespace();
+            if (pos == end || *pos++ != ':') {
+                return false;
+            }
+            skip_whitespace();
+            if (!value(depth + 1)) {
+                return false;
+            }
+            skip_whitespace();
+            if (pos == end) {
+                return false;
+            }
+            char c = *pos++;
+            if (c == '}') {
+                return true;
+            }
+            if (c != ',') {
+                return false;
+            }
+            skip_whitespace();
+        }
+        return false;
+    }
+
+    bool array(int depth) {
+        pos++;  // [
+        skip_whitespace();
+        if (pos < end && *pos == ']') {
+            pos++;
+            return true;
+        }
+        while (pos < end) {
+            if (!value(depth + 1)) {
+                return false;
+            }
+            skip_whitespace();
+            if (pos == end) {
+                return false;
+            }
+            char c = *pos++;
+            if (c == ']') {
+                return true;
+            }
+            if (c != ',') {
+                return false;
+            }
+            skip_whitespace();
+        }
+        return false;
+    }
+
+    bool value(int depth) {
+        if (pos == end || depth > MAX_DEPTH) {
+            return false;
+        }
+        switch (*pos) {
+            case '{': return object(depth);
+            case '[': return array(depth);
+            case '"': return string();
+            case 't': return literal("true");
+            case 'f': return literal("false");
+            case 'n': return literal("null");
+            default: return number();
+        }
+    }
+};
@@ -10,6 +10,13 @@
 #include <cstdlib>
 #include <csignal>
 #include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <unordered_map>
+#include <functional>
+#include <cstring>
+#include <climits>
+#include <cstdarg>
 
 #include "CivetServer.h"
 #include <hiredis/hiredis.h>
@@ -20,9 +27,25 @@
 #include <prometheus/registry.h>
 #include <prometheus/exposer.h>
 #include <prometheus/counter.h>
+#include <prometheus/gauge.h>
+#include <prometheus/histogram.h>
 
 #include "nlohmann/json.hpp"
 #include "trace_loger.hpp"
+#include "redis_pool.hpp"
+#include "redis_cluster.hpp"
+#include "mpsc_queue.hpp"
+#include "request_id.hpp"
+#include "async_logger.hpp"
+#include "response_writer.hpp"
+#include "stats_counter.hpp"
+#include "curl_share.hpp"
+#include "concurrency_limiter.hpp"
+#include "json_validate.hpp"
+#include "route_table.hpp"
+#include "priority_queue.hpp"
+#include "redis_async.hpp"
+#include "queue_shards.hpp"
 
 #if defined(USE_OPENTELEMETRY)
 using TracerType = TraceLogger;
@@ -77,12 +100,156 @@ std::string base64_encode(const std::string& input) {
 // Common variables
 std::atomic<bool> shutdown_flag(false);
 
+// Shared Redis stats keys, counted locally and flushed by a StatsFlusher
+LocalStatsCounter stats_redis_writes("stats:redis_writes");
+LocalStatsCounter stats_redis_reads("stats:redis_reads");
+
 // Environment variable for mode
 const char* MODE_ENV = "MODE";
 
 // Environment variable for number of threads
 const char* NUM_THREADS_ENV = "NUM_THREADS";
 
+// Environment variable for the number of worker threads, each with its own Redis and CURL handles
+const char* WORKER_THREADS_ENV = "WORKER_THREADS";
+
+// Environment variable for how many L2 calls one worker thread keeps in flight
+const char* L2_MAX_IN_FLIGHT_ENV = "L2_MAX_IN_FLIGHT";
+
+// Environment variable for the upper bound of requests a worker thread pops per round trip
+const char* WORKER_PREFETCH_MAX_ENV = "WORKER_PREFETCH_MAX";
+
+// Environment variables for reliable queue mode: requests stay in a per-worker
+// processing list until their reply is published (see ReliableQueue). The
+// visibility timeout and worker id apply to the streams transport as well.
+const char* RELIABLE_QUEUE_ENV = "RELIABLE_QUEUE";
+const char* VISIBILITY_TIMEOUT_MS_ENV = "VISIBILITY_TIMEOUT_MS";
+const char* WORKER_ID_ENV = "WORKER_ID";
+
+// Environment variable for how often the local stats counters are flushed to Redis
+const char* STATS_FLUSH_MS_ENV = "STATS_FLUSH_MS";
+
+// Environment variable for talking HTTP/2 to the L2 server (multiplexed, h2c for http://)
+const char* L2_HTTP2_ENV = "L2_HTTP2";
+
+// Environment variables for the adaptive limit on concurrent L2 calls of a worker process
+const char* L2_LIMIT_INITIAL_ENV = "L2_LIMIT_INITIAL";
+const char* L2_LIMIT_MIN_ENV = "L2_LIMIT_MIN";
+const char* L2_LIMIT_MAX_ENV = "L2_LIMIT_MAX";
+
+// Environment variables for the priority classes of the request queue (see
+// PriorityClasses): the classes, where unclassified requests go, the request header
+// that picks a class (unset: only routes do), and how long a worker lets a class
+// go unserved at most
+const char* PRIORITY_CLASSES_ENV = "PRIORITY_CLASSES";
+const char* PRIORITY_DEFAULT_ENV = "PRIORITY_DEFAULT";
+const char* PRIORITY_HEADER_ENV = "PRIORITY_HEADER";
+const char* PRIORITY_MAX_WAIT_MS_ENV = "PRIORITY_MAX_WAIT_MS";
+
+// Environment variables for the queue transport: "list" (RPUSH / LMPOP) or "stream"
+// (XADD / XREADGROUP, see StreamQueue), how many entries a stream keeps about,
+// and the consumer group of the workers
+const char* QUEUE_TRANSPORT_ENV = "QUEUE_TRANSPORT";
+const char* STREAM_MAXLEN_ENV = "STREAM_MAXLEN";
+const char* STREAM_GROUP_ENV = "STREAM_GROUP";
+
+// Environment variables for sharding the request queue: the Redis endpoints
+// ("host:port,..."), the number of shards, how the proxy picks one ("round_robin"
+// or "hash" of the path) and where a worker's threads start (see QueueShards)
+const char* REDIS_ENDPOINTS_ENV = "REDIS_ENDPOINTS";
+const char* QUEUE_SHARDS_ENV = "QUEUE_SHARDS";
+const char* SHARD_STRATEGY_ENV = "SHARD_STRATEGY";
+const char* WORKER_SHARD_OFFSET_ENV = "WORKER_SHARD_OFFSET";
+
+// Environment variable to treat REDIS_ENDPOINTS as the seed nodes of one Redis
+// Cluster instead of independent servers (see RedisCluster)
+const char* REDIS_CLUSTER_ENV = "REDIS_CLUSTER";
+
+// Environment variable for how often the worker samples the queue lengths
+const char* QUEUE_DEPTH_SAMPLE_MS_ENV = "QUEUE_DEPTH_SAMPLE_MS";
+
+// Environment variable for how long the proxy waits for the worker reply
+const char* RESPONSE_TIMEOUT_MS_ENV = "RESPONSE_TIMEOUT_MS";
+
+// Environment variable for the proxy instance id (names its reply list)
+const char* PROXY_ID_ENV = "PROXY_ID";
+
+// Environment variables for the proxy Redis connection pool
+const char* REDIS_POOL_SIZE_ENV = "REDIS_POOL_SIZE";
+const char* REDIS_HEALTH_CHECK_MS_ENV = "REDIS_HEALTH_CHECK_MS";
+
+// Environment variable for queueing requests through an AsyncRedis connection
+// instead of the pool
+const char* REDIS_ASYNC_ENV = "REDIS_ASYNC";
+
+// How long a request thread waits for a free pooled connection
+const std::chrono::milliseconds REDIS_ACQUIRE_TIMEOUT(1000);
+
+// Environment variables for the enqueue batcher (flush by size or by deadline)
+const char* ENQUEUE_BATCH_SIZE_ENV = "ENQUEUE_BATCH_SIZE";
+const char* ENQUEUE_FLUSH_US_ENV = "ENQUEUE_FLUSH_US";
+
+// Environment variable for how many sequential request ids are leased from Redis at once
+const char* REQUEST_ID_BLOCK_SIZE_ENV = "REQUEST_ID_BLOCK_SIZE";
+
+// Environment variables for request id generation: sequential ids from Redis or
+// time-ordered ids generated locally, tagged with the node id
+const char* USE_SEQUENTIAL_REQUEST_ID_ENV = "USE_SEQUENTIAL_REQUEST_ID";
+const char* NODE_ID_ENV = "NODE_ID";
+
+// Environment variables for streaming large request bodies to Redis in chunks
+const char* STREAM_BODY_THRESHOLD_ENV = "STREAM_BODY_THRESHOLD";
+const char* STREAM_CHUNK_SIZE_ENV = "STREAM_CHUNK_SIZE";
+
+// Environment variables for the async logger: level, keep every n-th per-request
+// line, and how many bytes of a body to show
+const char* LOG_LEVEL_ENV = "LOG_LEVEL";
+const char* LOG_SAMPLE_RATE_ENV = "LOG_SAMPLE_RATE";
+const char* LOG_BODY_MAX_ENV = "LOG_BODY_MAX";
+
+// Environment variable for the proxy route table (see RouteTable)
+const char* ROUTES_ENV = "ROUTES";
+
+long long get_env_int(const char* name, long long default_value) {
+    const char* value = std::getenv(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+    return atoll(value);
+}
+
+std::string get_env_string(const char* name, const std::string& default_value) {
+    const char* value = std::getenv(name);
+    return (value && *value) ? std::string(value) : default_value;
+}
+
+bool get_env_bool(const char* name, bool default_value) {
+    const char* value = std::getenv(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+    std::string str = value;
+    return str == "true" || str == "1" || str == "yes" || str == "on";
+}
+
+// Every entry of REDIS_ENDPOINTS as a standalone server, or with REDIS_CLUSTER all
+// of them as the seeds of a single cluster
+std::vector<std::unique_ptr<RedisCluster>> redis_endpoints_from_env() {
+    std::vector<RedisEndpoint> endpoints = RedisCluster::parse_endpoints(get_env_string(REDIS_ENDPOINTS_ENV, "valkey:6379"));
+    std::vector<std::unique_ptr<RedisCluster>> redis_endpoints;
+    if (get_env_bool(REDIS_CLUSTER_ENV, false)) {
+        redis_endpoints.emplace_back(new RedisCluster(endpoints, true));
+        return redis_endpoints;
+    }
+    for (const RedisEndpoint& endpoint : endpoints) {
+        redis_endpoints.emplace_back(new RedisCluster({endpoint}, false));
+    }
+    if (redis_endpoints.empty()) {
+        redis_endpoints.emplace_back(new RedisCluster({}, false));
+    }
+    return redis_endpoints;
+}
+
 // Initialize Tracer
 #ifdef USE_OPENTELEMETRY
 std::unique_ptr<TraceLogger> tracer;
@@ -168,26 +335,29 @@ prometheus::Counter& proxy_bytes_sent_counter = l2_proxy_bytes_sent_total.Add({}
 
 class HealthHandler : public CivetHandler {
 private:
-    redisContext* redis;
-    std::mutex redis_mutex;
+    RedisPool& redis_pool;
 
 public:
-    HealthHandler(redisContext* r) : redis(r) {}
+    HealthHandler(RedisPool& pool) : redis_pool(pool) {}
 
     bool handleGet(CivetServer *server, struct mg_connection *conn) {
-        std::lock_guard<std::mutex> lock(redis_mutex);
-        if (redis && redis->err) {
-            mg_printf(conn, "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\n\r\nRedis unavailable");
+        RedisPool::Lease redis = redis_pool.acquire(REDIS_ACQUIRE_TIMEOUT);
+        if (!redis) {
+            proxy_redis_errors_counter.Increment();
+            ResponseWriter::start() += "Redis unavailable";
+            ResponseWriter::send<503>(conn, TEXT_CONTENT_TYPE);
             return true;
         }
 
-        redisReply* reply = (redisReply*)redisCommand(redis, "PING");
+        redisReply* reply = redis->command("PING");
         proxy_redis_requests_counter.Increment();
         if (reply && reply->type == REDIS_REPLY_STATUS) {
-            mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nOK");
+            ResponseWriter::start() += "OK";
+            ResponseWriter::send<200>(conn, TEXT_CONTENT_TYPE);
         } else {
             proxy_redis_errors_counter.Increment();
-            mg_printf(conn, "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\n\r\nRedis unavailable");
+            ResponseWriter::start() += "Redis unavailable";
+            ResponseWriter::send<503>(conn, TEXT_CONTENT_TYPE);
         }
         if (reply) freeReplyObject(reply);
         return true;
@@ -196,26 +366,27 @@ public:
 
 class StatsHandler : public CivetHandler {
 private:
-    redisContext* redis;
-    std::mutex redis_mutex;
+    RedisPool& redis_pool;
 
 public:
-    StatsHandler(redisContext* r) : redis(r) {}
+    StatsHandler(RedisPool& pool) : redis_pool(pool) {}
 
     bool handleGet(CivetServer *server, struct mg_connection *conn) {
-        std::lock_guard<std::mutex> lock(redis_mutex);
-        if (!redis || redis->err) {
-            mg_printf(conn, "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\n\r\nRedis unavailable");
+        RedisPool::Lease redis = redis_pool.acquire(REDIS_ACQUIRE_TIMEOUT);
+        if (!redis) {
+            proxy_redis_errors_counter.Increment();
+            ResponseWriter::start() += "Redis unavailable";
+            ResponseWriter::send<503>(conn, TEXT_CONTENT_TYPE);
             return true;
         }
 
-        redisReply* writes_reply = (redisReply*)redisCommand(redis, "GET stats:redis_writes");
+        redisReply* writes_reply = redis->command("GET stats:redis_writes");
         proxy_redis_requests_counter.Increment();
         if (!(writes_reply && writes_reply->type == REDIS_REPLY_STRING)) {
             proxy_redis_errors_counter.Increment();
         }
 
-        redisReply* reads_reply = (redisReply*)redisCommand(redis, "GET stats:redis_reads");
+        redisReply* reads_reply = redis->command("GET stats:redis_reads");
         proxy_redis_requests_counter.Increment();
         if (!(reads_reply && reads_reply->type == REDIS_REPLY_STRING)) {
             proxy_redis_errors_counter.Increment();
@@ -230,14 +401,12 @@ public:
         if (reads_reply && reads_reply->type == REDIS_REPLY_STRING) {
             reads = atoll(reads_reply->str);
         }
+        // Include what this proxy has counted but not flushed yet
+        writes += stats_redis_writes.pending();
 
-        Json::Value stats;
-        stats["redis_writes"] = (Json::Int64)writes;
-        stats["redis_reads"] = (Json::Int64)reads;
-
-        Json::StreamWriterBuilder writer;
-        std::string stats_json = Json::writeString(writer, stats);
-        mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n%s", stats_json.c_str());
+        std::string& stats_json = ResponseWriter::start();
+        stats_json += "{\"redis_writes\":" + std::to_string(writes) + ",\"redis_reads\":" + std::to_string(reads) + "}";
+        ResponseWriter::send<200>(conn, JSON_CONTENT_TYPE);
 
         if (writes_reply) freeReplyObject(writes_reply);
         if (reads_reply) freeReplyObject(reads_reply);
@@ -245,409 +414,2338 @@ public:
     }
 };
 
-class RequestHandler : public CivetHandler {
-private:
-    redisContext* redis;
-    std::mutex redis_mutex;
-    bool use_sequential_id = true;
-    long long request_id_counter = 0;
-
-    std::string generate_uuid() {
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_int_distribution<> dis(0, 15);
-        std::stringstream ss;
-        ss << std::hex;
-        for (int i = 0; i < 32; i++) {
-            ss << dis(gen);
+// Appends data as a quoted JSON string
+void append_json_string(std::string& out, const char* data, size_t len) {
+    static const char hex_digits[] = "0123456789abcdef";
+    out.reserve(out.size() + len + 2);
+    out += '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = data[i];
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hex_digits[c >> 4];
+                    out += hex_digits[c & 0xf];
+                } else {
+                    out += (char)c;
+                }
         }
-        return ss.str();
     }
+    out += '"';
+}
 
-    std::string generate_sequential_id() {
-        std::lock_guard<std::mutex> lock(redis_mutex);
-        request_id_counter++;
-        return std::to_string(request_id_counter);
-    }
+// Reply slot a request thread waits on until the worker answers
+struct PendingResponse {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool ready = false;
+    std::string payload;
+    int status_code = 0;
 
-    void save_counter() {
-        std::lock_guard<std::mutex> lock(redis_mutex);
-        redisReply* reply = (redisReply*)redisCommand(redis, "SET request_id_counter %lld", request_id_counter);
-        proxy_redis_requests_counter.Increment();
-        if (!(reply && reply->type == REDIS_REPLY_STATUS)) {
-            proxy_redis_errors_counter.Increment();
+    // Set when the request failed inside the proxy and never reached the worker
+    std::string error;
+};
+
+// Correlates worker replies with waiting requests.
+// Every proxy owns one reply list (http:replies:<proxy id>) which is passed to the
+// worker as "reply_to". The worker pushes "<request id>\n<response json>" there,
+// a single listener thread pops it and wakes the request waiting for that id.
+// Popping consumes the reply, so nothing is left behind in Valkey.
+class ResponseDispatcher {
+private:
+    RedisCluster& cluster;
+    std::string reply_key;
+    std::atomic<bool> stopping{false};
+    std::thread listener;
+
+    std::mutex pending_mutex;
+    std::unordered_map<std::string, std::shared_ptr<PendingResponse>> pending;
+
+    void deliver(const char* data, size_t len) {
+        const char* newline = static_cast<const char*>(memchr(data, '\n', len));
+        if (!newline) {
+            LOG_ERROR("Malformed reply on %s", reply_key.c_str());
+            return;
         }
-        if (reply) freeReplyObject(reply);
-    }
+        std::string request_id(data, newline - data);
 
-public:
-    RequestHandler(redisContext* r) : redis(r), request_id_counter(0) {
-        // const char* env = std::getenv("USE_SEQUENTIAL_REQUEST_ID");
-        // use_sequential_id = env && std::string(env) == "true";
+        std::shared_ptr<PendingResponse> slot;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            auto it = pending.find(request_id);
+            if (it == pending.end()) {
+                // The request already timed out, nobody is waiting for it
+                return;
+            }
+            slot = it->second;
+            pending.erase(it);
+        }
 
-        // Load counter from Redis
-        std::lock_guard<std::mutex> lock(redis_mutex);
-        redisReply* reply = (redisReply*)redisCommand(redis, "GET request_id_counter");
-        proxy_redis_requests_counter.Increment();
-        if (reply && reply->type == REDIS_REPLY_STRING) {
-            request_id_counter = atoll(reply->str);
-        } else if (reply && reply->type == REDIS_REPLY_NIL) {
-            request_id_counter = 0;
-        } else {
-            proxy_redis_errors_counter.Increment();
-            std::cerr << "Failed to load request_id_counter from Redis, starting from 0" << std::endl;
-            request_id_counter = 0;
+        {
+            std::lock_guard<std::mutex> lock(slot->mutex);
+            slot->payload.assign(newline + 1, data + len - newline - 1);
+            slot->ready = true;
         }
-        if (reply) freeReplyObject(reply);
+        slot->cv.notify_one();
     }
 
-    ~RequestHandler() {
-        save_counter();
+    void run() {
+        RedisConnection redis(cluster);
+        while (!stopping) {
+            redisReply* reply = redis.command("BLPOP %s 1", reply_key.c_str());
+            proxy_redis_requests_counter.Increment();
+            if (!reply) {
+                // Not connected, the next command tries again
+                proxy_redis_errors_counter.Increment();
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+            if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2) {
+                deliver(reply->element[1]->str, reply->element[1]->len);
+            } else if (reply->type != REDIS_REPLY_NIL && reply->type != REDIS_REPLY_ARRAY) {
+                proxy_redis_errors_counter.Increment();
+            }
+            freeReplyObject(reply);
+        }
     }
 
-    bool handleGet(CivetServer *server, struct mg_connection *conn) {
-        return handle_request(server, conn, "GET", "");
+public:
+    ResponseDispatcher(RedisCluster& redis_cluster, const std::string& key)
+        : cluster(redis_cluster), reply_key(key) {
+        listener = std::thread(&ResponseDispatcher::run, this);
     }
 
-    bool handlePost(CivetServer *server, struct mg_connection *conn) {
-        const struct mg_request_info *req_info = mg_get_request_info(conn);
-        std::string body;
-        if (req_info->content_length > 0) {
-            char* buffer = new char[req_info->content_length + 1];
-            int read_len = mg_read(conn, buffer, req_info->content_length);
-            if (read_len > 0) {
-                buffer[read_len] = '\0';
-                body = std::string(buffer);
-            }
-            delete[] buffer;
+    ~ResponseDispatcher() {
+        stopping = true;
+        if (listener.joinable()) {
+            listener.join();
         }
-        proxy_bytes_received_counter.Increment(body.size());
-        return handle_request(server, conn, "POST", body);
     }
 
-    bool handle_request(CivetServer *server, struct mg_connection *conn, const std::string& method, const std::string& body = "") {
-        auto start_us = std::chrono::duration_cast<std::chrono::microseconds>(
-            std::chrono::system_clock::now().time_since_epoch()
-        ).count();
+    const std::string& key() const {
+        return reply_key;
+    }
 
-        proxy_client_requests_counter.Increment();
+    // Must be called before the request is pushed so a fast reply is not lost
+    std::shared_ptr<PendingResponse> expect(const std::string& request_id) {
+        auto slot = std::make_shared<PendingResponse>();
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending[request_id] = slot;
+        return slot;
+    }
 
-        const struct mg_request_info *req_info = mg_get_request_info(conn);
-        std::string path = req_info->request_uri ? req_info->request_uri : "/";
+    // Returns false if the reply is already being delivered
+    bool cancel(const std::string& request_id) {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        return pending.erase(request_id) > 0;
+    }
 
-        std::string request_id = use_sequential_id ? generate_sequential_id() : generate_uuid();
-
-        // Prepare request data for Redis
-        Json::Value request_data;
-        request_data["id"] = request_id;
-        request_data["method"] = method;
-        request_data["path"] = path;
-        if (!body.empty()) {
-            request_data["body"] = body;
-        }
-        std::cout << "request_data: " << request_data << std::endl;
-
-        bool redis_push_success = false;
-        // Push to Redis queue
-        if (redis && !redis->err) {
-            std::lock_guard<std::mutex> lock(redis_mutex);
-            Json::StreamWriterBuilder writer;
-            std::string request_json = Json::writeString(writer, request_data);
-            redisReply* reply = (redisReply*)redisCommand(redis, "RPUSH http:requests %s", request_json.c_str());
-            proxy_redis_requests_counter.Increment();
-            if (reply && reply->type == REDIS_REPLY_INTEGER) {
-                redis_push_success = true;
-            } else {
-                proxy_redis_errors_counter.Increment();
-            }
-            if (reply) freeReplyObject(reply);
-            // Increment write counter
-            redisReply* incr_reply = (redisReply*)redisCommand(redis, "INCR stats:redis_writes");
-            proxy_redis_requests_counter.Increment();
-            if (!(incr_reply && incr_reply->type == REDIS_REPLY_INTEGER)) {
-                proxy_redis_errors_counter.Increment();
+    // Answers a request that could not be handed to the worker
+    void fail(const std::string& request_id, int status_code, const std::string& message) {
+        std::shared_ptr<PendingResponse> slot;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            auto it = pending.find(request_id);
+            if (it == pending.end()) {
+                return;
             }
-            if (incr_reply) freeReplyObject(incr_reply);
-        } else {
-            proxy_redis_errors_counter.Increment();
+            slot = it->second;
+            pending.erase(it);
         }
+        proxy_client_errors_counter.Increment();
 
-        if (!redis_push_success) {
-            proxy_client_errors_counter.Increment();
+        {
+            std::lock_guard<std::mutex> lock(slot->mutex);
+            slot->status_code = status_code;
+            slot->error = message;
+            slot->ready = true;
         }
+        slot->cv.notify_one();
+    }
 
-        // Wait for response (simplified - in real implementation would poll Redis)
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-        // Send response
-        Json::Value response;
-        response["message"] = "Processed by C++ DMZ Proxy";
-        response["request_id"] = request_id;
-        response["language"] = "C++";
-
-        // Получаем timestamp в микросекундах UTC (стандарт для OpenObserve)
-        auto now = std::chrono::system_clock::now();
-        auto timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
-            now.time_since_epoch()
-        ).count();
-        response["timestamp"] = (Json::Int64)timestamp_us; // ← микросекунды UTC
+    bool wait(PendingResponse& slot, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(slot.mutex);
+        return slot.cv.wait_for(lock, timeout, [&slot] { return slot.ready; });
+    }
 
-        std::cout << "response" << response << std::endl;
+    // Blocks until the slot is answered, for a reply that is being delivered already
+    void wait_ready(PendingResponse& slot) {
+        std::unique_lock<std::mutex> lock(slot.mutex);
+        slot.cv.wait(lock, [&slot] { return slot.ready; });
+    }
+};
 
-        Json::StreamWriterBuilder writer;
-        std::string response_json = Json::writeString(writer, response);
-        proxy_bytes_sent_counter.Increment(response_json.size());
-        mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n%s", response_json.c_str());
+// Group commit for the request queue.
+// Request threads hand serialized envelopes over through a lock-free queue, a single
+// flusher thread collects them until ENQUEUE_BATCH_SIZE envelopes are pending or the
+// oldest one has waited ENQUEUE_FLUSH_US, then sends one multi-value RPUSH per
+// priority class in the batch (or one XADD per request with the streams
+// transport), pipelined per endpoint of the queue shards in the batch. With
+// AsyncRedis connections the flusher does not wait for the replies, so batches
+// overlap on the socket.
+class EnqueueBatcher {
+public:
+    struct Item {
+        std::atomic<Item*> next{nullptr};
+        std::string request_id;
+        std::string payload;
+        size_t priority = 0;
+        size_t shard = 0;
+    };
 
-        // Send tracing span
-#if defined(USE_OPENTELEMETRY) || defined(USE_JAEGER)
-        if (tracer) {
-            auto end_us = std::chrono::duration_cast<std::chrono::microseconds>(
-                std::chrono::system_clock::now().time_since_epoch()
-            ).count();
+    using FailureCallback = std::function<void(const std::string& request_id)>;
 
-            tracer->log_request(method, path, 200, start_us, end_us, "l2-proxy", request_id);
+private:
+    std::vector<RedisPool*> redis_pools;    // per endpoint
+    std::vector<AsyncRedis*> async_redis;   // per endpoint, empty to use the pools
+    const QueueShards& shards;
+    size_t class_count;
+    FailureCallback on_failure;
+    size_t batch_size;
+    std::chrono::microseconds flush_interval;
+
+    MpscQueue<Item> queue;
+    std::atomic<bool> stopping{false};
+
+    // Envelope buffers go back to the request threads once they have been sent,
+    // so large bodies do not cost a fresh allocation on every request
+    static constexpr size_t MAX_RECYCLED_CAPACITY = 4 * 1024 * 1024;
+    std::mutex buffers_mutex;
+    std::vector<std::string> free_buffers;
+    std::atomic<bool> flusher_sleeping{false};
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
+    std::thread flusher;
+
+    // One queue command and the requests it carries: a multi-value RPUSH per
+    // priority class, or with streams an XADD per request. Reused from batch to
+    // batch, only touched by the flusher thread.
+    struct Push {
+        size_t endpoint = 0;
+        bool sent = false;
+        std::vector<const char*> argv;
+        std::vector<size_t> argvlen;
+        std::vector<Item*> items;
+
+        void arg(const std::string& value) {
+            argv.push_back(value.data());
+            argvlen.push_back(value.size());
         }
-#endif
-
-        return true;
+    };
+    bool use_streams;
+    std::string stream_maxlen;
+    std::vector<Push> pushes;
+    size_t push_count = 0;
+    std::vector<int> class_push;
+
+    // Pushes sent through async_redis whose replies are not in yet, with the requests
+    // they carry. Shared with the reply callbacks, which outlive the batcher when
+    // Redis stops answering (see ~EnqueueBatcher).
+    struct AsyncPushes {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::unordered_map<uint64_t, std::vector<std::string>> waiting;
+        uint64_t next_push = 0;
+        FailureCallback on_failure;
+    };
+    static constexpr std::chrono::milliseconds STOP_TIMEOUT{1000};
+    std::shared_ptr<AsyncPushes> async_pushes = std::make_shared<AsyncPushes>();
+
+    Push& add_push(size_t shard) {
+        if (push_count == pushes.size()) {
+            pushes.emplace_back();
+        }
+        Push& push = pushes[push_count++];
+        push.endpoint = shards.endpoint_of(shard);
+        push.sent = false;
+        push.argv.clear();
+        push.argvlen.clear();
+        push.items.clear();
+        return push;
     }
-};
-
-void run_proxy() {
-    std::string redis_host = "valkey";
-    int redis_port = 6379;
 
-    redisContext* redis = redisConnect(redis_host.c_str(), redis_port);
-    if (redis == NULL || redis->err) {
-        std::cerr << "Redis connection error: " << (redis ? redis->errstr : "can't allocate redis context") << std::endl;
-        return;
+    void build_pushes(const std::vector<Item*>& batch) {
+        static const std::string RPUSH = "RPUSH", XADD = "XADD", MAXLEN = "MAXLEN", APPROXIMATE = "~",
+                                 AUTO_ID = "*", FIELD = "d";
+        push_count = 0;
+        std::fill(class_push.begin(), class_push.end(), -1);
+        for (Item* item : batch) {
+            const PriorityClasses::Class& priority = shards.classes(item->shard)[item->priority];
+            if (use_streams) {
+                Push& push = add_push(item->shard);
+                push.arg(XADD);
+                push.arg(priority.stream_key);
+                push.arg(MAXLEN);
+                push.arg(APPROXIMATE);
+                push.arg(stream_maxlen);
+                push.arg(AUTO_ID);
+                push.arg(FIELD);
+                push.arg(item->payload);
+                push.items.push_back(item);
+                continue;
+            }
+            size_t list = item->shard * class_count + item->priority;
+            if (class_push[list] < 0) {
+                class_push[list] = push_count;
+                Push& push = add_push(item->shard);
+                push.arg(RPUSH);
+                push.arg(priority.key);
+            }
+            Push& push = pushes[class_push[list]];
+            push.arg(item->payload);
+            push.items.push_back(item);
+        }
     }
 
-    HealthHandler health_handler(redis);
-    RequestHandler request_handler(redis);
-    StatsHandler stats_handler(redis);
-
-    // Read number of threads from environment variable
-    const char* num_threads_env = std::getenv(NUM_THREADS_ENV);
-    std::string num_threads = num_threads_env ? std::string(num_threads_env) : "32";
-
-	std::vector<std::string> cpp_options;
-	cpp_options.push_back("listening_ports");
-	cpp_options.push_back("8888");
-	cpp_options.push_back("num_threads");
-	cpp_options.push_back(num_threads);
-	cpp_options.push_back("enable_directory_listing");
-	cpp_options.push_back("no");
-//      cpp_options.push_back("max_connections");
-//      cpp_options.push_back("1024");
-	cpp_options.push_back("request_timeout_ms");
-	cpp_options.push_back("30000");
+    // RPUSH answers with the list length, XADD with the entry id
+    int expected_reply() const {
+        return use_streams ? REDIS_REPLY_STRING : REDIS_REPLY_INTEGER;
+    }
 
-    // Start Prometheus exposer
-    prometheus::Exposer exposer{"0.0.0.0:9090"};
-    exposer.RegisterCollectable(proxy_registry);
+    void flush(std::vector<Item*>& batch) {
+        build_pushes(batch);
+        if (!async_redis.empty()) {
+            send_async(batch);
+            return;
+        }
 
-    try {
-        CivetServer server(cpp_options);
-        server.addHandler("/health", &health_handler);
-        server.addHandler("/stats", &stats_handler);
-        server.addHandler("/", &request_handler);
+        // Send to every endpoint first, then collect the replies
+        std::vector<bool> used(redis_pools.size(), false);
+        for (size_t i = 0; i < push_count; i++) {
+            used[pushes[i].endpoint] = true;
+        }
+        std::vector<RedisPool::Lease> leases;
+        leases.reserve(redis_pools.size());
+        for (size_t endpoint = 0; endpoint < redis_pools.size(); endpoint++) {
+            leases.push_back(used[endpoint] ? redis_pools[endpoint]->acquire(REDIS_ACQUIRE_TIMEOUT) : RedisPool::Lease());
+            if (used[endpoint] && !leases.back()) {
+                proxy_redis_errors_counter.Increment();
+            }
+        }
+        for (size_t i = 0; i < push_count; i++) {
+            const RedisPool::Lease& redis = leases[pushes[i].endpoint];
+            if (redis) {
+                redis->append_argv(pushes[i].argv.size(), pushes[i].argv.data(), pushes[i].argvlen.data());
+                pushes[i].sent = true;
+                proxy_redis_requests_counter.Increment();
+            }
+        }
 
-        std::cout << "C++ DMZ Proxy listening on http://0.0.0.0:8888" << std::endl;
-        std::cout << "Prometheus metrics available at http://0.0.0.0:9090/metrics" << std::endl;
+        // A cluster connection can lose one node and still have the replies of the others
+        for (size_t i = 0; i < push_count; i++) {
+            const RedisPool::Lease& redis = leases[pushes[i].endpoint];
+            redisReply* reply = nullptr;
+            bool pushed = pushes[i].sent && redis->get_reply(&reply) == REDIS_OK && reply
+                          && reply->type == expected_reply();
+            if (reply) freeReplyObject(reply);
+            if (pushed) {
+                stats_redis_writes.add(pushes[i].items.size());
+            } else if (pushes[i].sent) {
+                proxy_redis_errors_counter.Increment();
+            }
 
-        while (!shutdown_flag)
-        {
-            sleep(1);
+            for (Item* item : pushes[i].items) {
+                if (!pushed) {
+                    on_failure(item->request_id);
+                }
+                recycle(std::move(item->payload));
+                delete item;
+            }
         }
+        batch.clear();
     }
-    catch (CivetException& e)
-    {
-        std::cout << "CivetException:" << e.what() << std::endl;
-    }
-
-    redisFree(redis);
-}
 
-// Prometheus registry for worker
-std::shared_ptr<prometheus::Registry> worker_registry = std::make_shared<prometheus::Registry>();
+    // Hands the pushes to async_redis and returns right away. The command is copied
+    // when it is queued, so the buffers are recycled now and only the request ids
+    // are kept for the reply, which arrives on the AsyncRedis thread.
+    void send_async(std::vector<Item*>& batch) {
+        for (size_t i = 0; i < push_count; i++) {
+            uint64_t push_id;
+            {
+                std::lock_guard<std::mutex> lock(async_pushes->mutex);
+                push_id = async_pushes->next_push++;
+                std::vector<std::string>& waiting = async_pushes->waiting[push_id];
+                for (Item* item : pushes[i].items) {
+                    waiting.push_back(std::move(item->request_id));
+                }
+            }
 
-// Prometheus counters for worker
-auto& l2_worker_requests_processed_total = prometheus::BuildCounter()
-    .Name("l2_worker_requests_processed_total")
-    .Help("Total number of requests processed by L2 worker")
-    .Register(*worker_registry);
+            proxy_redis_requests_counter.Increment();
+            size_t items = pushes[i].items.size();
+            int expected_type = expected_reply();
+            AsyncRedis* redis = async_redis[pushes[i].endpoint];
+            std::shared_ptr<AsyncPushes> state = async_pushes;
+            redis->command(pushes[i].argv.size(), pushes[i].argv.data(), pushes[i].argvlen.data(),
+                           [state, push_id, items, expected_type](redisReply* reply) {
+                std::vector<std::string> waiting;
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    auto it = state->waiting.find(push_id);
+                    if (it == state->waiting.end()) {
+                        // Failed already, the batcher stopped waiting for it
+                        return;
+                    }
+                    waiting = std::move(it->second);
+                    state->waiting.erase(it);
+                    if (state->waiting.empty()) {
+                        state->cv.notify_all();
+                    }
+                }
+                if (reply && reply->type == expected_type) {
+                    stats_redis_writes.add(items);
+                } else {
+                    proxy_redis_errors_counter.Increment();
+                    for (const std::string& request_id : waiting) {
+                        state->on_failure(request_id);
+                    }
+                }
+            });
+        }
 
-auto& l2_worker_redis_operations_total = prometheus::BuildCounter()
-    .Name("l2_worker_redis_operations_total")
-    .Help("Total number of Redis operations performed by L2 worker")
-    .Register(*worker_registry);
+        for (Item* item : batch) {
+            recycle(std::move(item->payload));
+            delete item;
+        }
+        batch.clear();
+    }
 
-auto& l2_worker_l2_calls_total = prometheus::BuildCounter()
-    .Name("l2_worker_l2_calls_total")
-    .Help("Total number of L2 server calls made by worker")
-    .Register(*worker_registry);
+    void run() {
+        std::vector<Item*> batch;
+        batch.reserve(batch_size);
+        std::chrono::steady_clock::time_point batch_deadline;
+
+        while (true) {
+            Item* item = queue.pop();
+            if (item) {
+                if (batch.empty()) {
+                    batch_deadline = std::chrono::steady_clock::now() + flush_interval;
+                }
+                batch.push_back(item);
+                if (batch.size() >= batch_size) {
+                    flush(batch);
+                }
+                continue;
+            }
 
-auto& l2_worker_redis_errors_total = prometheus::BuildCounter()
-    .Name("l2_worker_redis_errors_total")
-    .Help("Total number of Redis operation errors in L2 worker")
-    .Register(*worker_registry);
+            if (!batch.empty()) {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= batch_deadline || stopping) {
+                    flush(batch);
+                } else if (queue.empty()) {
+                    std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                        batch_deadline - now, std::chrono::microseconds(50)));
+                }
+                continue;
+            }
 
-auto& l2_worker_l2_errors_total = prometheus::BuildCounter()
-    .Name("l2_worker_l2_errors_total")
-    .Help("Total number of L2 server call errors in worker")
-    .Register(*worker_registry);
+            if (!queue.empty()) {
+                // A producer is in the middle of push()
+                std::this_thread::yield();
+                continue;
+            }
+            if (stopping) {
+                break;
+            }
 
-auto& l2_worker_bytes_received_total = prometheus::BuildCounter()
-    .Name("l2_worker_bytes_received_total")
-    .Help("Total number of bytes received from Redis")
-    .Register(*worker_registry);
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            flusher_sleeping.store(true);
+            if (queue.empty() && !stopping) {
+                wake_cv.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            flusher_sleeping.store(false);
+        }
+    }
 
-auto& l2_worker_bytes_sent_total = prometheus::BuildCounter()
-    .Name("l2_worker_bytes_sent_total")
-    .Help("Total number of bytes sent to Redis")
-    .Register(*worker_registry);
+public:
+    // One pool per endpoint of the shards; async is either empty, then batches go
+    // through the pools, or has a connection per endpoint as well. With streams
+    // every request is XADDed, capped at about stream_maxlen entries per stream.
+    EnqueueBatcher(std::vector<RedisPool*> pools, std::vector<AsyncRedis*> async, const QueueShards& queue_shards,
+                   FailureCallback failure_callback, size_t max_batch, std::chrono::microseconds interval,
+                   bool streams, long long maxlen)
+        : redis_pools(std::move(pools)), async_redis(std::move(async)), shards(queue_shards),
+          class_count(queue_shards.classes(0).size()), on_failure(std::move(failure_callback)),
+          batch_size(max_batch ? max_batch : 1), flush_interval(interval),
+          use_streams(streams), stream_maxlen(std::to_string(maxlen)),
+          class_push(queue_shards.size() * class_count, -1) {
+        async_pushes->on_failure = on_failure;
+        flusher = std::thread(&EnqueueBatcher::run, this);
+    }
 
-// Counter instances for worker
-prometheus::Counter& worker_requests_processed_counter = l2_worker_requests_processed_total.Add({});
-prometheus::Counter& worker_redis_operations_counter = l2_worker_redis_operations_total.Add({});
-prometheus::Counter& worker_l2_calls_counter = l2_worker_l2_calls_total.Add({});
-prometheus::Counter& worker_redis_errors_counter = l2_worker_redis_errors_total.Add({});
-prometheus::Counter& worker_l2_errors_counter = l2_worker_l2_errors_total.Add({});
-prometheus::Counter& worker_bytes_received_counter = l2_worker_bytes_received_total.Add({});
-prometheus::Counter& worker_bytes_sent_counter = l2_worker_bytes_sent_total.Add({});
+    ~EnqueueBatcher() {
+        stopping = true;
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            wake_cv.notify_one();
+        }
+        flusher.join();
 
-class L2Worker {
-private:
-    redisContext* redis;
-    CURL* curl;
-    std::string l2_server_url;
+        // AsyncRedis answers every command, if only with a failure, but has no timeout
+        // for a server that stays connected and stops answering
+        std::unordered_map<uint64_t, std::vector<std::string>> unanswered;
+        {
+            std::unique_lock<std::mutex> lock(async_pushes->mutex);
+            async_pushes->cv.wait_for(lock, STOP_TIMEOUT, [this] { return async_pushes->waiting.empty(); });
+            unanswered.swap(async_pushes->waiting);
+        }
+        for (const auto& push : unanswered) {
+            proxy_redis_errors_counter.Increment();
+            for (const std::string& request_id : push.second) {
+                on_failure(request_id);
+            }
+        }
+    }
 
-    static size_t write_callback(void* contents, size_t size, size_t nmemb, std::string* response) {
-        size_t total_size = size * nmemb;
-        response->append((char*)contents, total_size);
-        return total_size;
+    // Returns an empty string, possibly with capacity left over from an earlier request
+    std::string take_buffer() {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        if (free_buffers.empty()) {
+            return std::string();
+        }
+        std::string buffer = std::move(free_buffers.back());
+        free_buffers.pop_back();
+        return buffer;
     }
 
-public:
-    L2Worker(const std::string& redis_host, int redis_port, const std::string& server_url) 
-        : l2_server_url(server_url) {
-        
-        redis = redisConnect(redis_host.c_str(), redis_port);
-        if (redis == NULL || redis->err) {
-            std::cerr << "Redis connection error: " << (redis ? redis->errstr : "can't allocate redis context") << std::endl;
-            exit(1);
+    void recycle(std::string&& buffer) {
+        if (buffer.capacity() > MAX_RECYCLED_CAPACITY) {
+            return;
         }
+        buffer.clear();
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        if (free_buffers.size() < batch_size * 2) {
+            free_buffers.push_back(std::move(buffer));
+        }
+    }
 
-        curl = curl_easy_init();
-        if (!curl) {
-            std::cerr << "CURL initialization failed" << std::endl;
-            exit(1);
+    void submit(const std::string& request_id, std::string payload, size_t priority, size_t shard) {
+        Item* item = new Item();
+        item->request_id = request_id;
+        item->payload = std::move(payload);
+        item->priority = priority;
+        item->shard = shard;
+        queue.push(item);
+        if (flusher_sleeping.load()) {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            wake_cv.notify_one();
         }
     }
+};
 
-    ~L2Worker() {
-        if (redis) {
-            redisFree(redis);
+// Hands out sequential request ids without taking a lock on the hot path.
+// Ids are leased from Redis in blocks with INCRBY request_id_counter <block>, so the
+// counter in Redis is always ahead of every id in use: a crash only skips the rest
+// of a block and any number of proxies can share the counter. A background thread
+// leases the next block while the current one is still being consumed.
+class SequentialIdAllocator {
+private:
+    // Blocks are recycled, so "next" is poisoned while a new range is written
+    static constexpr long long EXHAUSTED = LLONG_MAX / 2;
+
+    struct Block {
+        std::atomic<long long> next{EXHAUSTED};
+        std::atomic<long long> end{0};
+    };
+
+    RedisPool& redis_pool;
+    long long block_size;
+    Block blocks[2];
+    std::atomic<Block*> current;
+
+    std::mutex mutex;
+    std::condition_variable spare_cv;
+    std::condition_variable refill_cv;
+    Block* spare;
+    bool spare_ready = false;
+    bool stopping = false;
+    std::thread prefetcher;
+
+    bool lease(Block& block) {
+        RedisPool::Lease redis = redis_pool.acquire(REDIS_ACQUIRE_TIMEOUT);
+        if (!redis) {
+            proxy_redis_errors_counter.Increment();
+            return false;
         }
-        if (curl) {
-            curl_easy_cleanup(curl);
+
+        redisReply* reply = redis->command("INCRBY request_id_counter %lld", block_size);
+        proxy_redis_requests_counter.Increment();
+        bool ok = reply && reply->type == REDIS_REPLY_INTEGER;
+        if (ok) {
+            long long last = reply->integer;
+            block.next.store(EXHAUSTED);
+            block.end.store(last + 1);
+            block.next.store(last + 1 - block_size);
+        } else {
+            proxy_redis_errors_counter.Increment();
+            LOG_ERROR("Failed to lease request ids from Redis");
         }
+        if (reply) freeReplyObject(reply);
+        return ok;
     }
 
-    std::string call_l2_server(const std::string& path, const std::string& body) {
-        worker_l2_calls_counter.Increment();
-
-        std::string url = l2_server_url + path;
-        std::string response_string;
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (spare_ready) {
+                refill_cv.wait(lock, [this] { return stopping || !spare_ready; });
+                continue;
+            }
 
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_string);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+            Block* target = spare;
+            lock.unlock();
+            bool ok = lease(*target);
+            lock.lock();
 
-        if (!body.empty()) {
-            curl_easy_setopt(curl, CURLOPT_POST, 1L);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, body.length());
-            struct curl_slist* headers = NULL;
-            headers = curl_slist_append(headers, "Content-Type: application/json");
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            if (ok) {
+                spare_ready = true;
+                spare_cv.notify_all();
+            } else {
+                refill_cv.wait_for(lock, std::chrono::seconds(1), [this] { return stopping; });
+            }
         }
+    }
 
-        CURLcode res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            worker_l2_errors_counter.Increment();
-            return "{\"error\": \"Failed to call L2 server: " + std::string(curl_easy_strerror(res)) + "\"}";
+public:
+    SequentialIdAllocator(RedisPool& pool, long long block)
+        : redis_pool(pool), block_size(block > 0 ? block : 1), current(&blocks[0]), spare(&blocks[1]) {
+        prefetcher = std::thread(&SequentialIdAllocator::run, this);
+    }
+
+    ~SequentialIdAllocator() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        refill_cv.notify_all();
+        spare_cv.notify_all();
+        prefetcher.join();
+    }
+
+    // Returns false if no block could be leased within timeout
+    bool allocate(long long& id, std::chrono::milliseconds timeout) {
+        while (true) {
+            Block* block = current.load();
+            // end must be read before next, see lease()
+            long long end = block->end.load();
+            long long candidate = block->next.fetch_add(1);
+            if (candidate < end) {
+                id = candidate;
+                return true;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (current.load() != block) {
+                continue;
+            }
+            if (!spare_cv.wait_for(lock, timeout, [this] { return spare_ready || stopping; }) || !spare_ready) {
+                return false;
+            }
+            current.store(spare);
+            spare = block;
+            spare_ready = false;
+            refill_cv.notify_one();
+        }
+    }
+};
+
+class RequestHandler : public CivetHandler {
+private:
+    RedisPool& redis_pool;
+    SequentialIdAllocator& id_allocator;
+    ResponseDispatcher& dispatcher;
+    EnqueueBatcher& batcher;
+    const RouteTable& routes;
+    const PriorityClasses& classes;
+    QueueShards& shards;
+    std::string priority_header;
+    std::chrono::milliseconds response_timeout;
+    bool use_sequential_id = true;
+    size_t stream_threshold;
+    size_t stream_chunk_size;
+
+    // headers: extra "Name: value\r\n" lines to send along, e.g. the Allow header of a 405
+    void send_error(struct mg_connection *conn, int status_code, const std::string& request_id, const std::string& message,
+                    const std::string& headers = "") {
+        std::string& response_json = ResponseWriter::start();
+        response_json += "{\"error\":";
+        append_json_string(response_json, message.data(), message.size());
+        response_json += ",\"request_id\":";
+        append_json_string(response_json, request_id.data(), request_id.size());
+        response_json += '}';
+        if (headers.empty()) {
+            proxy_bytes_sent_counter.Increment(ResponseWriter::send(conn, status_code, JSON_CONTENT_TYPE));
+        } else {
+            std::string all_headers = headers + JSON_CONTENT_TYPE;
+            proxy_bytes_sent_counter.Increment(
+                ResponseWriter::send(conn, status_code, all_headers.data(), all_headers.size()));
+        }
+    }
+
+    // Relays the worker's {"status_code", "headers", "body"} reply to the client
+    int send_worker_response(struct mg_connection *conn, const std::string& request_id, const std::string& payload) {
+        Json::Value response_data;
+        Json::Reader reader;
+        if (!reader.parse(payload, response_data) || !response_data.isObject()) {
+            proxy_client_errors_counter.Increment();
+            send_error(conn, 502, request_id, "Malformed worker response");
+            return 502;
+        }
+
+        int status_code = response_data.get("status_code", 200).asInt();
+
+        std::string& body = ResponseWriter::start();
+        const Json::Value& body_value = response_data["body"];
+        if (body_value.isString()) {
+            const char* begin = nullptr;
+            const char* end = nullptr;
+            body_value.getString(&begin, &end);
+            body.append(begin, end - begin);
+        } else if (body_value.isObject() || body_value.isArray()) {
+            // Pass the worker's JSON through byte for byte, using where the reader found it
+            body.append(payload, body_value.getOffsetStart(), body_value.getOffsetLimit() - body_value.getOffsetStart());
+        } else if (!body_value.isNull()) {
+            thread_local Json::StreamWriterBuilder writer = [] {
+                Json::StreamWriterBuilder compact;
+                compact["indentation"] = "";
+                return compact;
+            }();
+            body += Json::writeString(writer, body_value);
+        }
+
+        thread_local std::string headers;
+        headers.clear();
+        const Json::Value& header_values = response_data["headers"];
+        if (header_values.isObject()) {
+            for (const auto& name : header_values.getMemberNames()) {
+                if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+                    continue;
+                }
+                headers += name;
+                headers += ": ";
+                headers += header_values[name].asString();
+                headers += "\r\n";
+            }
+        }
+
+        proxy_bytes_sent_counter.Increment(ResponseWriter::send(conn, status_code, headers.data(), headers.size()));
+        return status_code;
+    }
+
+public:
+    RequestHandler(RedisPool& pool, SequentialIdAllocator& ids, ResponseDispatcher& d, EnqueueBatcher& b,
+                   const RouteTable& r, const PriorityClasses& priority_classes, QueueShards& queue_shards,
+                   std::chrono::milliseconds timeout)
+        : redis_pool(pool), id_allocator(ids), dispatcher(d), batcher(b), routes(r), classes(priority_classes),
+          shards(queue_shards), response_timeout(timeout) {
+        priority_header = get_env_string(PRIORITY_HEADER_ENV, "");
+        use_sequential_id = get_env_bool(USE_SEQUENTIAL_REQUEST_ID_ENV, true);
+        stream_threshold = get_env_int(STREAM_BODY_THRESHOLD_ENV, 256 * 1024);
+        stream_chunk_size = std::max(1LL, get_env_int(STREAM_CHUNK_SIZE_ENV, 64 * 1024));
+    }
+
+    bool handleGet(CivetServer *server, struct mg_connection *conn) {
+        return handle_request(server, conn, "GET");
+    }
+
+    bool handlePost(CivetServer *server, struct mg_connection *conn) {
+        return handle_request(server, conn, "POST");
+    }
+
+    bool handlePut(CivetServer *server, struct mg_connection *conn) {
+        return handle_request(server, conn, "PUT");
+    }
+
+    bool handleDelete(CivetServer *server, struct mg_connection *conn) {
+        return handle_request(server, conn, "DELETE");
+    }
+
+    bool handlePatch(CivetServer *server, struct mg_connection *conn) {
+        return handle_request(server, conn, "PATCH");
+    }
+
+    // Reads the request body. Bodies up to stream_threshold bytes go straight into the
+    // tail of the envelope, larger ones are streamed to Redis (see stream_body).
+    // Returns 0 or the HTTP status the request has to fail with.
+    int read_body(struct mg_connection *conn, const std::string& request_id, std::string& envelope, size_t& body_bytes) {
+        const struct mg_request_info *req_info = mg_get_request_info(conn);
+        size_t header_len = envelope.size();
+        long long content_length = req_info->content_length;
+
+        if (content_length > (long long)stream_threshold) {
+            return stream_body(conn, request_id, envelope, header_len, content_length, body_bytes);
+        }
+
+        if (content_length >= 0) {
+            envelope.resize(header_len + content_length);
+            size_t got = 0;
+            while (got < (size_t)content_length) {
+                int read_len = mg_read(conn, &envelope[header_len + got], content_length - got);
+                if (read_len <= 0) {
+                    break;
+                }
+                got += read_len;
+            }
+            envelope.resize(header_len + got);
+            body_bytes = got;
+            return got == (size_t)content_length ? 0 : 400;
+        }
+
+        // Chunked transfer encoding: buffer until the end of the body, switch to
+        // streaming once it grows past the threshold
+        while (envelope.size() - header_len <= stream_threshold) {
+            size_t used = envelope.size();
+            envelope.resize(used + stream_chunk_size);
+            int read_len = mg_read(conn, &envelope[used], stream_chunk_size);
+            envelope.resize(used + (read_len > 0 ? read_len : 0));
+            if (read_len <= 0) {
+                body_bytes = envelope.size() - header_len;
+                return 0;
+            }
+        }
+        return stream_body(conn, request_id, envelope, header_len, -1, body_bytes);
+    }
+
+    // Pushes the body to the list http:body:<id> one chunk at a time, so a connection
+    // never holds more than one chunk no matter how large the upload is. Bytes already
+    // buffered after header_len go first, then remaining bytes (-1: until EOF) are read.
+    // The envelope keeps no body and tells the worker where to find it instead.
+    int stream_body(struct mg_connection *conn, const std::string& request_id, std::string& envelope,
+                    size_t header_len, long long remaining, size_t& body_bytes) {
+        std::string body_key = "http:body:" + request_id;
+        RedisPool::Lease redis = redis_pool.acquire(REDIS_ACQUIRE_TIMEOUT);
+        if (!redis) {
+            proxy_redis_errors_counter.Increment();
+            return 503;
+        }
+
+        size_t chunks = 0;
+        auto push_chunk = [&](const char* data, size_t len) {
+            const char* argv[3] = {"RPUSH", body_key.c_str(), data};
+            size_t argvlen[3] = {5, body_key.size(), len};
+            redisReply* reply = redis->command_argv(3, argv, argvlen);
+            proxy_redis_requests_counter.Increment();
+            bool ok = reply && reply->type == REDIS_REPLY_INTEGER;
+            if (reply) freeReplyObject(reply);
+
+            // Abandoned uploads must not stay in Valkey
+            if (ok && chunks++ == 0) {
+                reply = redis->command("EXPIRE %s 60", body_key.c_str());
+                proxy_redis_requests_counter.Increment();
+                ok = reply && reply->type == REDIS_REPLY_INTEGER;
+                if (reply) freeReplyObject(reply);
+            }
+            if (!ok) {
+                proxy_redis_errors_counter.Increment();
+            }
+            return ok;
+        };
+
+        body_bytes = 0;
+        bool redis_ok = true;
+        for (size_t offset = header_len; offset < envelope.size() && redis_ok; offset += stream_chunk_size) {
+            size_t len = std::min(stream_chunk_size, envelope.size() - offset);
+            redis_ok = push_chunk(envelope.data() + offset, len);
+            body_bytes += len;
+        }
+        envelope.resize(header_len);
+
+        thread_local std::string chunk;
+        chunk.resize(stream_chunk_size);
+        bool eof = false;
+        while (redis_ok && !eof && remaining != 0) {
+            size_t filled = 0;
+            while (filled < stream_chunk_size && remaining != 0) {
+                size_t want = stream_chunk_size - filled;
+                if (remaining > 0 && (long long)want > remaining) {
+                    want = remaining;
+                }
+                int read_len = mg_read(conn, &chunk[filled], want);
+                if (read_len <= 0) {
+                    eof = true;
+                    break;
+                }
+                filled += read_len;
+                if (remaining > 0) {
+                    remaining -= read_len;
+                }
+            }
+            if (filled > 0) {
+                redis_ok = push_chunk(chunk.data(), filled);
+                body_bytes += filled;
+            }
+        }
+
+        if (!redis_ok || (eof && remaining > 0)) {
+            redisReply* reply = redis->command("DEL %s", body_key.c_str());
+            proxy_redis_requests_counter.Increment();
+            if (reply) freeReplyObject(reply);
+            return redis_ok ? 400 : 502;
+        }
+
+        // Reopen the metadata line ("...}\n") and point the worker at the chunks
+        envelope.resize(header_len - 2);
+        envelope += ",\"body_key\":";
+        append_json_string(envelope, body_key.data(), body_key.size());
+        envelope += ",\"body_length\":" + std::to_string(body_bytes) + "}\n";
+        return 0;
+    }
+
+    bool handle_request(CivetServer *server, struct mg_connection *conn, const std::string& method) {
+        auto start_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count();
+
+        proxy_client_requests_counter.Increment();
+
+        const struct mg_request_info *req_info = mg_get_request_info(conn);
+        std::string path = req_info->request_uri ? req_info->request_uri : "/";
+
+        // Rejected routes never get an id or touch Redis
+        const RouteTable::Route& route = routes.match(method, path);
+        if (route.action == RouteTable::Action::REJECT) {
+            proxy_client_errors_counter.Increment();
+            std::string headers;
+            if (route.status == 405) {
+                headers = "Allow: " + routes.allowed(path) + "\r\n";
+            }
+            send_error(conn, route.status, "", mg_get_response_code_text(conn, route.status), headers);
+            trace_request(method, path, route.status, start_us, "");
+            return true;
+        }
+
+        std::string request_id;
+        if (use_sequential_id) {
+            long long sequential_id = 0;
+            if (!id_allocator.allocate(sequential_id, REDIS_ACQUIRE_TIMEOUT)) {
+                proxy_client_errors_counter.Increment();
+                send_error(conn, 503, "", "Request id allocation failed");
+                trace_request(method, path, 503, start_us, "");
+                return true;
+            }
+            request_id = std::to_string(sequential_id);
+        } else {
+            char id_buffer[TimeOrderedIdGenerator::LENGTH];
+            TimeOrderedIdGenerator::next(id_buffer);
+            request_id.assign(id_buffer, sizeof(id_buffer));
+        }
+
+        int status_code = route.action == RouteTable::Action::LOCAL
+                              ? send_local_response(conn, request_id)
+                              : enqueue_request(conn, method, path, request_id, priority_of(conn, route));
+
+        trace_request(method, path, status_code, start_us, request_id);
+        return true;
+    }
+
+    // The canned reply for requests the workers do not answer
+    int send_local_response(struct mg_connection *conn, const std::string& request_id) {
+        // Получаем timestamp в микросекундах UTC (стандарт для OpenObserve)
+        auto now = std::chrono::system_clock::now();
+        auto timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            now.time_since_epoch()
+        ).count();
+
+        // Send response
+        std::string& response_json = ResponseWriter::start();
+        response_json += "{\"message\":\"Processed by C++ DMZ Proxy\",\"request_id\":";
+        append_json_string(response_json, request_id.data(), request_id.size());
+        response_json += ",\"language\":\"C++\",\"timestamp\":";
+        response_json += std::to_string(timestamp_us); // ← микросекунды UTC
+        response_json += '}';
+        LOG_SAMPLED(LogLevel::DEBUG, "response: %.*s",
+                    (int)(response_json.size() - ResponseWriter::HEAD_ROOM),
+                    response_json.data() + ResponseWriter::HEAD_ROOM);
+        proxy_bytes_sent_counter.Increment(ResponseWriter::send<200>(conn, JSON_CONTENT_TYPE));
+        return 200;
+    }
+
+    // The priority header wins over the route, unknown class names are ignored
+    size_t priority_of(struct mg_connection *conn, const RouteTable::Route& route) {
+        if (!priority_header.empty()) {
+            const char* value = mg_get_header(conn, priority_header.c_str());
+            int index = value ? classes.find(value) : -1;
+            if (index >= 0) {
+                return index;
+            }
+        }
+        int index = route.priority.empty() ? -1 : classes.find(route.priority);
+        return index >= 0 ? index : classes.default_index();
+    }
+
+    // Queues the request for the workers and waits for their reply; only POST is
+    // routed here (see RouteTable). Returns the status sent to the client.
+    int enqueue_request(struct mg_connection *conn, const std::string& method, const std::string& path,
+                        const std::string& request_id, size_t priority) {
+        // Envelope: one line of JSON metadata, then the raw body (see parse_envelope).
+        // The body is never copied or escaped, it goes from mg_read to RPUSH as is;
+        // large bodies are streamed separately and only referenced here.
+        std::string envelope = batcher.take_buffer();
+        envelope += "{\"id\":";
+        append_json_string(envelope, request_id.data(), request_id.size());
+        envelope += ",\"method\":";
+        append_json_string(envelope, method.data(), method.size());
+        envelope += ",\"path\":";
+        append_json_string(envelope, path.data(), path.size());
+        envelope += ",\"reply_to\":";
+        append_json_string(envelope, dispatcher.key().data(), dispatcher.key().size());
+        // For the queue wait time the worker reports per priority class
+        envelope += ",\"enqueued_ms\":";
+        envelope += std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count());
+        envelope += "}\n";
+
+        size_t body_bytes = 0;
+        int body_status = read_body(conn, request_id, envelope, body_bytes);
+        if (body_status != 0) {
+            proxy_client_errors_counter.Increment();
+            send_error(conn, body_status, request_id,
+                                body_status == 400 ? "Incomplete request body" : "Failed to store request body");
+            return body_status;
+        }
+        proxy_bytes_received_counter.Increment(body_bytes);
+        LOG_SAMPLED(LogLevel::INFO, "request_data: %.*s body: %zu bytes",
+                    (int)envelope.find('\n'), envelope.c_str(), body_bytes);
+
+        std::shared_ptr<PendingResponse> pending = dispatcher.expect(request_id);
+
+        // Queue the envelope, the batcher answers the request with 502 if the push fails
+        batcher.submit(request_id, std::move(envelope), priority, shards.pick(path));
+
+        int status_code = 200;
+        if (!dispatcher.wait(*pending, response_timeout) && dispatcher.cancel(request_id)) {
+            proxy_client_errors_counter.Increment();
+            status_code = 504;
+            send_error(conn, status_code, request_id, "Timed out waiting for worker response");
+        } else {
+            // The reply may have raced the timeout, in which case it is being delivered right now
+            dispatcher.wait_ready(*pending);
+            if (!pending->error.empty()) {
+                status_code = pending->status_code;
+                send_error(conn, status_code, request_id, pending->error);
+            } else {
+                status_code = send_worker_response(conn, request_id, pending->payload);
+            }
+        }
+
+        return status_code;
+    }
+
+    // Send tracing span
+    void trace_request([[maybe_unused]] const std::string& method, [[maybe_unused]] const std::string& path,
+                       [[maybe_unused]] int status_code, [[maybe_unused]] long long start_us,
+                       [[maybe_unused]] const std::string& request_id) {
+#if defined(USE_OPENTELEMETRY) || defined(USE_JAEGER)
+        if (tracer) {
+            auto end_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()
+            ).count();
+
+            tracer->log_request(method, path, status_code, start_us, end_us, "l2-proxy", request_id);
+        }
+#endif
+    }
+};
+
+void run_proxy() {
+    std::vector<std::unique_ptr<RedisCluster>> redis_endpoints = redis_endpoints_from_env();
+    PriorityClasses priority_classes(get_env_string(PRIORITY_CLASSES_ENV, ""), get_env_string(PRIORITY_DEFAULT_ENV, ""));
+    QueueShards shards(redis_endpoints.size(), std::max(1LL, get_env_int(QUEUE_SHARDS_ENV, 1)),
+                       QueueShards::strategy_from_string(get_env_string(SHARD_STRATEGY_ENV, "round_robin")),
+                       priority_classes, redis_endpoints[0]->enabled());
+
+    // Read number of threads from environment variable
+    const char* num_threads_env = std::getenv(NUM_THREADS_ENV);
+    std::string num_threads = num_threads_env ? std::string(num_threads_env) : "32";
+
+    // One connection per civetweb thread by default, so request threads never queue on Redis
+    RedisPool redis_pool(*redis_endpoints[0],
+                         get_env_int(REDIS_POOL_SIZE_ENV, atoi(num_threads.c_str())),
+                         std::chrono::milliseconds(get_env_int(REDIS_HEALTH_CHECK_MS_ENV, 30000)));
+    {
+        RedisPool::Lease redis = redis_pool.acquire(REDIS_ACQUIRE_TIMEOUT);
+        if (!redis) {
+            const RedisEndpoint& seed = redis_endpoints[0]->seed_nodes().front();
+            std::cerr << "Redis connection error: can't connect to " << seed.host << ":" << seed.port << std::endl;
+            return;
+        }
+    }
+
+    std::string proxy_id = get_env_string(PROXY_ID_ENV, "");
+    if (proxy_id.empty()) {
+        char hostname[256] = {0};
+        gethostname(hostname, sizeof(hostname) - 1);
+        proxy_id = std::string(hostname) + ":" + std::to_string(getpid());
+    }
+    std::chrono::milliseconds response_timeout(get_env_int(RESPONSE_TIMEOUT_MS_ENV, 5000));
+
+    TimeOrderedIdGenerator::set_node_id(get_env_int(NODE_ID_ENV, TimeOrderedIdGenerator::node_id_from_name(proxy_id)));
+
+    ResponseDispatcher dispatcher(*redis_endpoints[0], "http:replies:" + proxy_id);
+
+    // Declared before the batcher so that its last batch is still counted
+    StatsFlusher stats_flusher(redis_pool, {&stats_redis_writes},
+                               std::chrono::milliseconds(std::max(10LL, get_env_int(STATS_FLUSH_MS_ENV, 1000))),
+                               proxy_redis_requests_counter, proxy_redis_errors_counter);
+
+    // Queue shards on the other endpoints only see the batcher's single flusher thread
+    std::vector<std::unique_ptr<RedisPool>> shard_pools;
+    std::vector<RedisPool*> queue_pools{&redis_pool};
+    for (size_t i = 1; i < shards.endpoint_count(); i++) {
+        shard_pools.emplace_back(new RedisPool(*redis_endpoints[i], 1,
+                                               std::chrono::milliseconds(get_env_int(REDIS_HEALTH_CHECK_MS_ENV, 30000))));
+        queue_pools.push_back(shard_pools.back().get());
+    }
+
+    // Must outlive the batcher, which waits a while for its replies. AsyncRedis talks to a
+    // single server and does not follow cluster redirects.
+    std::vector<std::unique_ptr<AsyncRedis>> async_connections;
+    std::vector<AsyncRedis*> async_redis;
+    if (get_env_bool(REDIS_ASYNC_ENV, false) && redis_endpoints[0]->enabled()) {
+        std::cerr << REDIS_ASYNC_ENV << " is not supported with " << REDIS_CLUSTER_ENV
+                  << ", enqueueing through the connection pool" << std::endl;
+    } else if (get_env_bool(REDIS_ASYNC_ENV, false)) {
+        for (const auto& endpoint : redis_endpoints) {
+            const RedisEndpoint& server = endpoint->seed_nodes().front();
+            async_connections.emplace_back(new AsyncRedis(server.host, server.port));
+            async_redis.push_back(async_connections.back().get());
+        }
+    }
+
+    EnqueueBatcher batcher(queue_pools, async_redis, shards,
+                           [&dispatcher](const std::string& request_id) {
+                               dispatcher.fail(request_id, 502, "Failed to enqueue request");
+                           },
+                           get_env_int(ENQUEUE_BATCH_SIZE_ENV, 64),
+                           std::chrono::microseconds(get_env_int(ENQUEUE_FLUSH_US_ENV, 200)),
+                           get_env_string(QUEUE_TRANSPORT_ENV, "list") == "stream",
+                           std::max(1LL, get_env_int(STREAM_MAXLEN_ENV, 1000000)));
+
+    SequentialIdAllocator id_allocator(redis_pool, get_env_int(REQUEST_ID_BLOCK_SIZE_ENV, 1000));
+
+    HealthHandler health_handler(redis_pool);
+    RouteTable routes(get_env_string(ROUTES_ENV, RouteTable::DEFAULT_ROUTES));
+    if (!routes.valid()) {
+        std::cerr << "Invalid " << ROUTES_ENV << ": " << get_env_string(ROUTES_ENV, RouteTable::DEFAULT_ROUTES) << std::endl;
+        exit(1);
+    }
+    RequestHandler request_handler(redis_pool, id_allocator, dispatcher, batcher, routes, priority_classes, shards,
+                                   response_timeout);
+    StatsHandler stats_handler(redis_pool);
+
+	std::vector<std::string> cpp_options;
+	cpp_options.push_back("listening_ports");
+	cpp_options.push_back("8888");
+	cpp_options.push_back("num_threads");
+	cpp_options.push_back(num_threads);
+	cpp_options.push_back("enable_directory_listing");
+	cpp_options.push_back("no");
+//      cpp_options.push_back("max_connections");
+//      cpp_options.push_back("1024");
+	cpp_options.push_back("request_timeout_ms");
+	cpp_options.push_back("30000");
+
+    // Start Prometheus exposer
+    prometheus::Exposer exposer{"0.0.0.0:9090"};
+    exposer.RegisterCollectable(proxy_registry);
+
+    try {
+        CivetServer server(cpp_options);
+        server.addHandler("/health", &health_handler);
+        server.addHandler("/stats", &stats_handler);
+        server.addHandler("/", &request_handler);
+
+        std::cout << "C++ DMZ Proxy listening on http://0.0.0.0:8888" << std::endl;
+        std::cout << "Prometheus metrics available at http://0.0.0.0:9090/metrics" << std::endl;
+
+        while (!shutdown_flag)
+        {
+            sleep(1);
+        }
+    }
+    catch (CivetException& e)
+    {
+        std::cout << "CivetException:" << e.what() << std::endl;
+    }
+}
+
+// Prometheus registry for worker
+std::shared_ptr<prometheus::Registry> worker_registry = std::make_shared<prometheus::Registry>();
+
+// Prometheus counters for worker
+auto& l2_worker_requests_processed_total = prometheus::BuildCounter()
+    .Name("l2_worker_requests_processed_total")
+    .Help("Total number of requests processed by L2 worker")
+    .Register(*worker_registry);
+
+auto& l2_worker_redis_operations_total = prometheus::BuildCounter()
+    .Name("l2_worker_redis_operations_total")
+    .Help("Total number of Redis operations performed by L2 worker")
+    .Register(*worker_registry);
+
+auto& l2_worker_l2_calls_total = prometheus::BuildCounter()
+    .Name("l2_worker_l2_calls_total")
+    .Help("Total number of L2 server calls made by worker")
+    .Register(*worker_registry);
+
+auto& l2_worker_redis_errors_total = prometheus::BuildCounter()
+    .Name("l2_worker_redis_errors_total")
+    .Help("Total number of Redis operation errors in L2 worker")
+    .Register(*worker_registry);
+
+auto& l2_worker_l2_errors_total = prometheus::BuildCounter()
+    .Name("l2_worker_l2_errors_total")
+    .Help("Total number of L2 server call errors in worker")
+    .Register(*worker_registry);
+
+auto& l2_worker_bytes_received_total = prometheus::BuildCounter()
+    .Name("l2_worker_bytes_received_total")
+    .Help("Total number of bytes received from Redis")
+    .Register(*worker_registry);
+
+auto& l2_worker_bytes_sent_total = prometheus::BuildCounter()
+    .Name("l2_worker_bytes_sent_total")
+    .Help("Total number of bytes sent to Redis")
+    .Register(*worker_registry);
+
+auto& l2_worker_l2_concurrency_limit = prometheus::BuildGauge()
+    .Name("l2_worker_l2_concurrency_limit")
+    .Help("Current adaptive limit on concurrent L2 server calls")
+    .Register(*worker_registry);
+
+// Counter instances for worker
+prometheus::Counter& worker_requests_processed_counter = l2_worker_requests_processed_total.Add({});
+prometheus::Counter& worker_redis_operations_counter = l2_worker_redis_operations_total.Add({});
+prometheus::Counter& worker_l2_calls_counter = l2_worker_l2_calls_total.Add({});
+prometheus::Counter& worker_redis_errors_counter = l2_worker_redis_errors_total.Add({});
+prometheus::Counter& worker_l2_errors_counter = l2_worker_l2_errors_total.Add({});
+prometheus::Counter& worker_bytes_received_counter = l2_worker_bytes_received_total.Add({});
+prometheus::Counter& worker_bytes_sent_counter = l2_worker_bytes_sent_total.Add({});
+prometheus::Gauge& worker_l2_concurrency_limit_gauge = l2_worker_l2_concurrency_limit.Add({});
+
+// Per priority class, labelled with the class name in run_worker()
+auto& l2_worker_queue_depth = prometheus::BuildGauge()
+    .Name("l2_worker_queue_depth")
+    .Help("Requests waiting in the queue of a priority class")
+    .Register(*worker_registry);
+
+auto& l2_worker_queue_wait_seconds = prometheus::BuildHistogram()
+    .Name("l2_worker_queue_wait_seconds")
+    .Help("Time requests of a priority class spent queued before a worker took them")
+    .Register(*worker_registry);
+
+const prometheus::Histogram::BucketBoundaries QUEUE_WAIT_BUCKETS{
+    0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+// Splits a queued request into its metadata and body.
+// Current proxies send "<one line of JSON metadata>\n<raw body>", older ones a single
+// JSON document with the body as a string; legacy_body keeps that string alive.
+// Streamed bodies are not inline, the metadata carries body_key instead.
+bool parse_envelope(const std::string& message, Json::Value& request_data,
+                    const char*& body, size_t& body_len, std::string& legacy_body) {
+    Json::Reader reader;
+    size_t newline = message.find('\n');
+    if (newline != std::string::npos
+        && reader.parse(message.data(), message.data() + newline, request_data, false)
+        && request_data.isObject() && request_data.isMember("id")) {
+        body = message.data() + newline + 1;
+        body_len = message.size() - newline - 1;
+        return true;
+    }
+
+    request_data = Json::Value();
+    if (!reader.parse(message, request_data, false) || !request_data.isObject()) {
+        return false;
+    }
+    legacy_body = request_data["body"].asString();
+    body = legacy_body.data();
+    body_len = legacy_body.size();
+    return true;
+}
+
+// A request taken from the queue; seq is its position in the processing list in
+// reliable mode, priority the class and shard the queue shard it was taken from
+struct QueuedMessage {
+    std::string data;
+    uint64_t seq = 0;
+    size_t priority = 0;
+    size_t shard = 0;
+};
+
+// Reliable queue mode. Requests are moved (LMOVE) from the queue into the
+// worker's own processing list instead of being popped, and leave it only once
+// their reply has been published. Acknowledgements come back out of order, so a
+// ledger tracks which entries at the head of the list are done and trims them
+// off with one LTRIM per batch.
+// Every worker keeps a heartbeat key alive for the visibility timeout. Once it has
+// expired, any other worker's reaper moves the leftover list back to the head of
+// the queue (the most urgent class, see PriorityClasses::requeue_key). The timeout
+// therefore has to be longer than the worker can stall.
+// Delivery is at-least-once: acknowledged entries not trimmed yet when a worker
+// dies are processed again.
+// Trimming by count relies on the ledger matching the list position for position.
+// A Redis error can break that (LMOVEs applied whose replies never arrived, an
+// LTRIM applied twice), so after one the ledger is dropped and the whole processing
+// list requeued before anything else is fetched. Requests still in flight then run
+// a second time, and their acknowledgements are ignored.
+class ReliableQueue {
+private:
+    static constexpr const char* REGISTRY_KEY = "http:workers";
+    static constexpr const char* DEAD_LETTER_KEY = "http:requests:dead";
+    static constexpr size_t ACK_BATCH = 32;
+
+    RedisConnection* redis;
+    const PriorityClasses& classes;
+    size_t shard;
+    std::string registry_key;
+    std::string processing_key;
+    std::string dead_letter_key;
+    std::chrono::milliseconds visibility_timeout;
+
+    uint64_t ledger_base = 0;      // sequence number of the processing list head
+    std::deque<bool> ledger;       // acknowledged flags from ledger_base on
+    size_t trim_pending = 0;       // acknowledged entries at the head, not trimmed yet
+    bool ledger_lost = false;      // the processing list may not match the ledger
+    std::chrono::steady_clock::time_point next_trim;
+    std::chrono::steady_clock::time_point next_heartbeat;
+    std::chrono::steady_clock::time_point next_reap;
+
+    static std::string heartbeat_key(const std::string& list_key) {
+        return list_key + ":alive";
+    }
+
+    bool command(int expected_type, const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        redisReply* reply = redis->vcommand(format, args);
+        va_end(args);
+        worker_redis_operations_counter.Increment();
+        bool ok = reply && reply->type == expected_type;
+        if (!ok) {
+            worker_redis_errors_counter.Increment();
+        }
+        if (reply) freeReplyObject(reply);
+        return ok;
+    }
+
+    // Moves a processing list back to the head of the queue, keeping its order.
+    // Returns false if Redis failed before the list was empty.
+    bool requeue(const std::string& list_key, size_t& moved) {
+        moved = 0;
+        while (true) {
+            worker_redis_operations_counter.Increment();
+            redisReply* reply = redis->command("LMOVE %s %s RIGHT LEFT", list_key.c_str(),
+                                               classes.requeue_key().c_str());
+            int type = reply ? reply->type : REDIS_REPLY_ERROR;
+            if (reply) freeReplyObject(reply);
+            if (type == REDIS_REPLY_NIL) {
+                return true;
+            }
+            if (type != REDIS_REPLY_STRING) {
+                worker_redis_errors_counter.Increment();
+                return false;
+            }
+            moved++;
+        }
+    }
+
+    // Forgets the ledger, so acknowledgements of what was fetched so far are
+    // ignored, and requeues the processing list; false while Redis is failing
+    bool resync() {
+        ledger_base += ledger.size();
+        ledger.clear();
+        trim_pending = 0;
+        size_t moved = 0;
+        ledger_lost = !requeue(processing_key, moved);
+        if (moved) {
+            LOG_WARN("Requeued %zu requests of %s after a Redis error", moved, processing_key.c_str());
+        }
+        return !ledger_lost;
+    }
+
+    void reap() {
+        worker_redis_operations_counter.Increment();
+        redisReply* reply = redis->command("SMEMBERS %s", registry_key.c_str());
+        std::vector<std::string> lists;
+        if (reply && reply->type == REDIS_REPLY_ARRAY) {
+            for (size_t i = 0; i < reply->elements; i++) {
+                lists.emplace_back(reply->element[i]->str, reply->element[i]->len);
+            }
+        } else {
+            worker_redis_errors_counter.Increment();
+        }
+        if (reply) freeReplyObject(reply);
+
+        for (const std::string& list_key : lists) {
+            if (list_key == processing_key) {
+                continue;
+            }
+            worker_redis_operations_counter.Increment();
+            reply = redis->command("EXISTS %s", heartbeat_key(list_key).c_str());
+            bool alive = !reply || reply->type != REDIS_REPLY_INTEGER || reply->integer != 0;
+            if (reply) freeReplyObject(reply);
+            if (alive) {
+                continue;
+            }
+
+            size_t moved = 0;
+            if (!requeue(list_key, moved)) {
+                continue;
+            }
+            command(REDIS_REPLY_INTEGER, "SREM %s %s", registry_key.c_str(), list_key.c_str());
+            if (moved) {
+                LOG_WARN("Requeued %zu requests of dead worker list %s", moved, list_key.c_str());
+            }
+        }
+    }
+
+public:
+    // The registry, processing and dead letter lists carry the hash tag of the shard,
+    // a cluster keeps them in the slot of its queue so LMOVE can go between them
+    ReliableQueue(RedisConnection* connection, const PriorityClasses& priority_classes, size_t queue_shard,
+                  const std::string& worker_id, std::chrono::milliseconds timeout)
+        : redis(connection), classes(priority_classes), shard(queue_shard),
+          registry_key(std::string(REGISTRY_KEY) + priority_classes.tag()),
+          processing_key("http:processing:" + worker_id + priority_classes.tag()),
+          dead_letter_key(std::string(DEAD_LETTER_KEY) + priority_classes.tag()),
+          visibility_timeout(timeout) {}
+
+    // Registers the processing list and requeues what a previous run with the same
+    // worker id left behind
+    void start() {
+        heartbeat();
+        command(REDIS_REPLY_INTEGER, "SADD %s %s", registry_key.c_str(), processing_key.c_str());
+        size_t moved = 0;
+        ledger_lost = !requeue(processing_key, moved);
+        if (moved) {
+            LOG_WARN("Requeued %zu requests left in %s", moved, processing_key.c_str());
+        }
+        next_reap = std::chrono::steady_clock::now() + visibility_timeout;
+    }
+
+    void heartbeat() {
+        command(REDIS_REPLY_STATUS, "SET %s 1 PX %lld", heartbeat_key(processing_key).c_str(),
+                (long long)visibility_timeout.count());
+        next_heartbeat = std::chrono::steady_clock::now() + visibility_timeout / 3;
+    }
+
+    // Moves up to count requests of the first non-empty class in order into the
+    // processing list with pipelined LMOVEs. When every class is empty, waits up to
+    // block_ms (if set) for one request of the first class with BLMOVE, at most 100 ms
+    // with several classes so the others are looked at again soon.
+    size_t fetch(std::deque<QueuedMessage>& out, size_t count, long long block_ms, const std::vector<size_t>& order) {
+        if (ledger_lost && !resync()) {
+            return 0;
+        }
+        for (size_t priority : order) {
+            size_t fetched = move_from(priority, count, out);
+            if (fetched || ledger_lost) {
+                return fetched;
+            }
+        }
+        if (block_ms <= 0) {
+            return 0;
+        }
+
+        flush_acks(true);
+        if (classes.size() > 1) {
+            block_ms = std::min(block_ms, 100LL);
+        }
+        worker_redis_operations_counter.Increment();
+        redisReply* reply = redis->command("BLMOVE %s %s LEFT RIGHT %.3f",
+                                           classes[order[0]].key.c_str(), processing_key.c_str(), block_ms / 1000.0);
+        size_t fetched = 0;
+        if (reply && reply->type == REDIS_REPLY_STRING) {
+            out.push_back(QueuedMessage{std::string(reply->str, reply->len), track(), order[0], shard});
+            fetched = 1;
+        } else if (!reply || reply->type != REDIS_REPLY_NIL) {
+            worker_redis_errors_counter.Increment();
+            // Without a reply the move may still have happened
+            if (!reply) {
+                ledger_lost = true;
+            }
+        }
+        if (reply) freeReplyObject(reply);
+        return fetched;
+    }
+
+    size_t move_from(size_t priority, size_t count, std::deque<QueuedMessage>& out) {
+        for (size_t i = 0; i < count; i++) {
+            redis->append("LMOVE %s %s LEFT RIGHT", classes[priority].key.c_str(), processing_key.c_str());
+        }
+        worker_redis_operations_counter.Increment(count);
+
+        size_t fetched = 0;
+        for (size_t i = 0; i < count; i++) {
+            redisReply* reply = nullptr;
+            if (redis->get_reply(&reply) != REDIS_OK || !reply) {
+                // The rest of the LMOVEs may have been applied all the same
+                worker_redis_errors_counter.Increment();
+                ledger_lost = true;
+                break;
+            }
+            if (reply->type == REDIS_REPLY_STRING) {
+                out.push_back(QueuedMessage{std::string(reply->str, reply->len), track(), priority, shard});
+                fetched++;
+            } else if (reply->type != REDIS_REPLY_NIL) {
+                worker_redis_errors_counter.Increment();
+            }
+            freeReplyObject(reply);
+        }
+        return fetched;
+    }
+
+    uint64_t track() {
+        ledger.push_back(false);
+        return ledger_base + ledger.size() - 1;
+    }
+
+    void ack(uint64_t seq) {
+        if (seq < ledger_base || seq - ledger_base >= ledger.size()) {
+            return;
+        }
+        ledger[seq - ledger_base] = true;
+        while (!ledger.empty() && ledger.front()) {
+            ledger.pop_front();
+            ledger_base++;
+            trim_pending++;
+        }
+        flush_acks(false);
+    }
+
+    // Trims acknowledged entries off the head of the processing list, once per
+    // ACK_BATCH acknowledgements or 100 ms
+    void flush_acks(bool force) {
+        auto now = std::chrono::steady_clock::now();
+        if (ledger_lost || trim_pending == 0 || (!force && trim_pending < ACK_BATCH && now < next_trim)) {
+            return;
+        }
+        // Trimming again after a lost reply could drop entries nobody processed
+        ledger_lost = !command(REDIS_REPLY_STATUS, "LTRIM %s %lld -1", processing_key.c_str(),
+                               (long long)trim_pending);
+        trim_pending = 0;
+        next_trim = now + std::chrono::milliseconds(100);
+    }
+
+    void dead_letter(const std::string& message) {
+        command(REDIS_REPLY_INTEGER, "RPUSH %s %b", dead_letter_key.c_str(), message.data(), message.size());
+    }
+
+    // Heartbeat, pending acknowledgements and the reaper; called from the event loop
+    void maintain() {
+        auto now = std::chrono::steady_clock::now();
+        flush_acks(false);
+        if (now >= next_heartbeat) {
+            heartbeat();
+        }
+        if (now >= next_reap) {
+            reap();
+            next_reap = now + visibility_timeout;
+        }
+    }
+
+    // Graceful shutdown: everything still in the processing list was never started
+    void stop() {
+        flush_acks(true);
+        size_t moved = 0;
+        requeue(processing_key, moved);
+        command(REDIS_REPLY_INTEGER, "SREM %s %s", registry_key.c_str(), processing_key.c_str());
+        command(REDIS_REPLY_INTEGER, "DEL %s", heartbeat_key(processing_key).c_str());
+    }
+};
+
+// Streams transport (QUEUE_TRANSPORT=stream). The proxy XADDs each request to the
+// stream of its priority class, capped with MAXLEN ~ STREAM_MAXLEN, so memory stays
+// bounded; a backlog beyond the cap loses its oldest entries. Workers read through
+// one consumer group with XREADGROUP, every worker thread as its own consumer, so
+// each entry is delivered once and stays in the consumer's pending list until its
+// reply is published and it is XACKed, in batches like the reliable queue trims.
+// Entries pending for longer than the visibility timeout (their consumer died or
+// could not publish) are taken over with XAUTOCLAIM by the first worker to look.
+class StreamQueue {
+private:
+    static constexpr const char* DEAD_LETTER_KEY = "http:requests:dead";
+    static constexpr size_t ACK_BATCH = 32;
+    static constexpr size_t CLAIM_COUNT = 100;
+
+    RedisConnection* redis;
+    const PriorityClasses& classes;
+    size_t shard;
+    std::string group;
+    std::string consumer;
+    std::string dead_letter_key;
+    std::chrono::milliseconds visibility_timeout;
+
+    // Delivered entries by sequence number, until they are acknowledged
+    uint64_t next_seq = 0;
+    std::unordered_map<uint64_t, std::pair<size_t, std::string>> delivered;
+    std::vector<std::vector<std::string>> acks;  // per class, not sent yet
+    size_t acks_pending = 0;
+    std::vector<std::string> claim_cursor;       // per class, XAUTOCLAIM scan position
+    std::chrono::steady_clock::time_point next_ack_flush;
+    std::chrono::steady_clock::time_point next_claim;
+
+    std::vector<const char*> argv;
+    std::vector<size_t> argvlen;
+
+    redisReply* command(const std::vector<std::string>& args) {
+        argv.clear();
+        argvlen.clear();
+        for (const std::string& arg : args) {
+            argv.push_back(arg.data());
+            argvlen.push_back(arg.size());
+        }
+        worker_redis_operations_counter.Increment();
+        redisReply* reply = redis->command_argv(argv.size(), argv.data(), argvlen.data());
+        if (!reply || reply->type == REDIS_REPLY_ERROR) {
+            worker_redis_errors_counter.Increment();
+        }
+        return reply;
+    }
+
+    // Takes [[id, [field, value, ...]], ...] as returned by XREADGROUP and XAUTOCLAIM;
+    // nil in place of an entry is one XAUTOCLAIM found trimmed, see ack_trimmed
+    size_t take_entries(const redisReply* entries, size_t priority, std::deque<QueuedMessage>& out) {
+        size_t taken = 0;
+        for (size_t i = 0; i < entries->elements; i++) {
+            const redisReply* entry = entries->element[i];
+            if (entry->type != REDIS_REPLY_ARRAY || entry->elements != 2 || entry->element[0]->type != REDIS_REPLY_STRING) {
+                continue;
+            }
+            std::string id(entry->element[0]->str, entry->element[0]->len);
+            const redisReply* fields = entry->element[1];
+            const redisReply* data = nullptr;
+            for (size_t f = 0; fields->type == REDIS_REPLY_ARRAY && f + 1 < fields->elements; f += 2) {
+                if (fields->element[f]->len == 1 && fields->element[f]->str[0] == 'd') {
+                    data = fields->element[f + 1];
+                }
+            }
+
+            uint64_t seq = next_seq++;
+            delivered.emplace(seq, std::make_pair(priority, id));
+            if (!data || data->type != REDIS_REPLY_STRING) {
+                // Trimmed away while pending, or not written by the proxy
+                ack(seq);
+                continue;
+            }
+            out.push_back(QueuedMessage{std::string(data->str, data->len), seq, priority, shard});
+            taken++;
+        }
+        return taken;
+    }
+
+    // One XREADGROUP for new entries of the given classes, blocking for block_ms if set
+    size_t read(const std::vector<size_t>& priorities, size_t count, long long block_ms, std::deque<QueuedMessage>& out) {
+        std::vector<std::string> args{"XREADGROUP", "GROUP", group, consumer, "COUNT", std::to_string(count)};
+        if (block_ms > 0) {
+            args.push_back("BLOCK");
+            args.push_back(std::to_string(block_ms));
+        }
+        args.push_back("STREAMS");
+        for (size_t priority : priorities) {
+            args.push_back(classes[priority].stream_key);
+        }
+        args.insert(args.end(), priorities.size(), ">");
+
+        redisReply* reply = command(args);
+        size_t fetched = 0;
+        if (reply && reply->type == REDIS_REPLY_ARRAY) {
+            for (size_t i = 0; i < reply->elements; i++) {
+                const redisReply* stream = reply->element[i];
+                if (stream->type != REDIS_REPLY_ARRAY || stream->elements != 2
+                    || stream->element[0]->type != REDIS_REPLY_STRING || stream->element[1]->type != REDIS_REPLY_ARRAY) {
+                    continue;
+                }
+                int priority = classes.find_stream_key(stream->element[0]->str, stream->element[0]->len);
+                if (priority >= 0) {
+                    fetched += take_entries(stream->element[1], priority, out);
+                }
+            }
+        } else if (reply && reply->type != REDIS_REPLY_NIL && reply->type != REDIS_REPLY_ERROR) {
+            worker_redis_errors_counter.Increment();
+        }
+        if (reply) freeReplyObject(reply);
+        return fetched;
+    }
+
+    // Redis 6.2 claims pending entries that were trimmed from the stream like any
+    // other but returns nil for them, without the id, so they would stay pending
+    // with this consumer for good. Looks them up among its pending entries of the
+    // range [from, to) the claim went through and acknowledges those the stream no
+    // longer has. Redis 7 drops such entries from the pending list by itself.
+    void ack_trimmed(size_t priority, const std::string& from, const std::string& to) {
+        const std::string& key = classes[priority].stream_key;
+        redisReply* pending = command({"XPENDING", key, group, from, to == "0-0" ? "+" : "(" + to,
+                                       std::to_string(CLAIM_COUNT), consumer});
+        size_t trimmed = 0;
+        for (size_t i = 0; pending && pending->type == REDIS_REPLY_ARRAY && i < pending->elements; i++) {
+            const redisReply* info = pending->element[i];
+            if (info->type != REDIS_REPLY_ARRAY || info->elements < 1 || info->element[0]->type != REDIS_REPLY_STRING) {
+                continue;
+            }
+            std::string id(info->element[0]->str, info->element[0]->len);
+            redisReply* entry = command({"XRANGE", key, id, id});
+            if (entry && entry->type == REDIS_REPLY_ARRAY && entry->elements == 0) {
+                acks[priority].push_back(std::move(id));
+                acks_pending++;
+                trimmed++;
+            }
+            if (entry) freeReplyObject(entry);
         }
+        if (pending) freeReplyObject(pending);
+        if (trimmed) {
+            LOG_WARN("Acknowledging %zu claimed requests trimmed from %s", trimmed, key.c_str());
+            flush_acks(true);
+        }
+    }
 
-        return response_string;
+    // Takes over entries other consumers left pending for the visibility timeout
+    size_t claim(std::deque<QueuedMessage>& out) {
+        size_t claimed = 0;
+        for (size_t i = 0; i < classes.size(); i++) {
+            redisReply* reply = command({"XAUTOCLAIM", classes[i].stream_key, group, consumer,
+                                         std::to_string(visibility_timeout.count()), claim_cursor[i],
+                                         "COUNT", std::to_string(CLAIM_COUNT)});
+            if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements >= 2
+                && reply->element[0]->type == REDIS_REPLY_STRING && reply->element[1]->type == REDIS_REPLY_ARRAY) {
+                std::string from = std::move(claim_cursor[i]);
+                claim_cursor[i].assign(reply->element[0]->str, reply->element[0]->len);
+                const redisReply* entries = reply->element[1];
+                claimed += take_entries(entries, i, out);
+                for (size_t e = 0; e < entries->elements; e++) {
+                    if (entries->element[e]->type == REDIS_REPLY_NIL) {
+                        ack_trimmed(i, from, claim_cursor[i]);
+                        break;
+                    }
+                }
+            }
+            if (reply) freeReplyObject(reply);
+        }
+        if (claimed) {
+            LOG_WARN("Claimed %zu requests left pending by other consumers", claimed);
+        }
+        return claimed;
     }
 
-    void process_request(const std::string& request_json) {
-        auto start_us = std::chrono::duration_cast<std::chrono::microseconds>(
-            std::chrono::system_clock::now().time_since_epoch()
-        ).count();
+public:
+    StreamQueue(RedisConnection* connection, const PriorityClasses& priority_classes, size_t queue_shard,
+                const std::string& group_name, const std::string& consumer_name, std::chrono::milliseconds timeout)
+        : redis(connection), classes(priority_classes), shard(queue_shard), group(group_name), consumer(consumer_name),
+          dead_letter_key(std::string(DEAD_LETTER_KEY) + priority_classes.tag()), visibility_timeout(timeout), acks(priority_classes.size()), claim_cursor(priority_classes.size(), "0-0") {}
+
+    // Creates the streams and the group where missing. A new group starts at the
+    // beginning, so requests queued before the first worker came up are not skipped.
+    void start() {
+        for (size_t i = 0; i < classes.size(); i++) {
+            redisReply* reply = command({"XGROUP", "CREATE", classes[i].stream_key, group, "0", "MKSTREAM"});
+            if (reply && reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "BUSYGROUP", 9) != 0) {
+                std::cerr << "Failed to create consumer group on " << classes[i].stream_key << ": " << reply->str << std::endl;
+            }
+            if (reply) freeReplyObject(reply);
+        }
+        next_claim = std::chrono::steady_clock::now();
+    }
 
-        worker_requests_processed_counter.Increment();
-        worker_bytes_received_counter.Increment(request_json.size());
+    // Reads up to count new entries of the first class in order that has any. When
+    // every class is empty, waits up to block_ms (if set) on all of them.
+    size_t fetch(std::deque<QueuedMessage>& out, size_t count, long long block_ms, const std::vector<size_t>& order) {
+        for (size_t priority : order) {
+            size_t fetched = read(std::vector<size_t>{priority}, count, 0, out);
+            if (fetched) {
+                return fetched;
+            }
+        }
+        if (block_ms <= 0) {
+            return 0;
+        }
+        flush_acks(true);
+        return read(order, count, block_ms, out);
+    }
 
-        Json::Value request_data;
-        Json::Reader reader;
+    void ack(uint64_t seq) {
+        auto it = delivered.find(seq);
+        if (it == delivered.end()) {
+            return;
+        }
+        acks[it->second.first].push_back(std::move(it->second.second));
+        delivered.erase(it);
+        acks_pending++;
+        flush_acks(false);
+    }
+
+    // Forgets an entry without acknowledging it, XAUTOCLAIM hands it out again
+    void release(uint64_t seq) {
+        delivered.erase(seq);
+    }
 
-        if (!reader.parse(request_json, request_data)) {
-            std::cerr << "Failed to parse JSON request" << std::endl;
+    // One XACK per class, once per ACK_BATCH acknowledgements or 100 ms
+    void flush_acks(bool force) {
+        auto now = std::chrono::steady_clock::now();
+        if (acks_pending == 0 || (!force && acks_pending < ACK_BATCH && now < next_ack_flush)) {
             return;
         }
+        for (size_t i = 0; i < classes.size(); i++) {
+            if (acks[i].empty()) {
+                continue;
+            }
+            std::vector<std::string> args{"XACK", classes[i].stream_key, group};
+            args.insert(args.end(), acks[i].begin(), acks[i].end());
+            redisReply* reply = command(args);
+            if (reply && reply->type == REDIS_REPLY_INTEGER) {
+                acks_pending -= acks[i].size();
+                acks[i].clear();
+            }
+            if (reply) freeReplyObject(reply);
+        }
+        next_ack_flush = now + std::chrono::milliseconds(100);
+    }
+
+    void dead_letter(const std::string& message) {
+        redisReply* reply = command({"RPUSH", dead_letter_key, message});
+        if (reply) freeReplyObject(reply);
+    }
+
+    // Pending acknowledgements and claiming abandoned entries; called from the event loop
+    size_t maintain(std::deque<QueuedMessage>& out) {
+        auto now = std::chrono::steady_clock::now();
+        flush_acks(false);
+        if (now < next_claim) {
+            return 0;
+        }
+        next_claim = now + std::max<std::chrono::milliseconds>(std::chrono::milliseconds(100), visibility_timeout / 4);
+        return claim(out);
+    }
+
+    // Graceful shutdown. Entries read but never started stay pending and are
+    // claimed by another worker after the visibility timeout.
+    void stop() {
+        flush_acks(true);
+    }
+};
+
+// One request on its way through the worker. The easy handle points into message
+// and body_storage, so a call must not move while the transfer is running.
+struct L2Call {
+    std::string message;
+    std::string body_storage;
+    Json::Value request_data;
+    const char* body = nullptr;
+    size_t body_len = 0;
+    std::string request_id;
+    std::string method;
+    std::string path;
+    std::string url;
+    std::string response;
+    CURL* easy = nullptr;
+    long long start_us = 0;
+    uint64_t seq = 0;
+    size_t priority = 0;
+    size_t shard = 0;
+};
+
+// Pipelined writer for worker results on its own connection. publish() only appends
+// the commands for a result to the output buffer; flush() sends everything queued
+// since the last flush and reads all replies back in one pass, checking each reply
+// against the type its command returns. A call stays owned by the publisher until
+// its replies are in, so reliable mode acknowledges only published results.
+class ResultPublisher {
+public:
+    using DoneCallback = std::function<void(std::unique_ptr<L2Call>, bool published)>;
+
+private:
+    struct Pending {
+        std::unique_ptr<L2Call> call;
+        std::vector<int> expected_types;
+    };
+
+    RedisConnection redis;
+    std::vector<Pending> batch;
+
+public:
+    explicit ResultPublisher(RedisCluster& cluster) : redis(cluster) {
+        if (!redis.connect()) {
+            std::cerr << "Redis connection error: " << redis.errstr() << std::endl;
+            exit(1);
+        }
+    }
+
+    ResultPublisher(const ResultPublisher&) = delete;
+    ResultPublisher& operator=(const ResultPublisher&) = delete;
+
+    bool empty() const {
+        return batch.empty();
+    }
+
+    void publish(std::unique_ptr<L2Call> call, const std::string& response_str) {
+        Pending pending;
+        std::string reply_to = call->request_data["reply_to"].asString();
+        if (reply_to.empty()) {
+            // Legacy proxies poll http:response:<id>
+            redis.append("SETEX http:response:%s 60 %b",
+                         call->request_id.c_str(), response_str.data(), response_str.size());
+            pending.expected_types.push_back(REDIS_REPLY_STATUS);
+        } else {
+            // Hand the reply straight to the waiting proxy, see ResponseDispatcher
+            std::string message = call->request_id + "\n" + response_str;
+            redis.append("RPUSH %s %b", reply_to.c_str(), message.data(), message.size());
+            // Do not leave replies behind if the proxy is gone
+            redis.append("EXPIRE %s 60", reply_to.c_str());
+            pending.expected_types.push_back(REDIS_REPLY_INTEGER);
+            pending.expected_types.push_back(REDIS_REPLY_INTEGER);
+        }
+        worker_redis_operations_counter.Increment(pending.expected_types.size());
+        pending.call = std::move(call);
+        batch.push_back(std::move(pending));
+    }
 
-        std::string method = request_data["method"].asString();
-        if (method != "POST") {
-            std::cout << "Skipping non-POST request: " << method << std::endl;
+    void flush(const DoneCallback& done) {
+        if (batch.empty()) {
             return;
         }
+        // Every reply is looked at: a cluster connection can lose one node and still
+        // have published what went to the others
+        bool connection_ok = true;
+        for (Pending& pending : batch) {
+            bool published = true;
+            for (size_t i = 0; i < pending.expected_types.size(); i++) {
+                redisReply* reply = nullptr;
+                if (redis.get_reply(&reply) != REDIS_OK) {
+                    connection_ok = false;
+                }
+                // Only the write of the reply itself decides, a failed EXPIRE does not
+                // make it worth running the request again
+                if (!(reply && reply->type == pending.expected_types[i])) {
+                    worker_redis_errors_counter.Increment();
+                    if (i == 0) {
+                        published = false;
+                    }
+                }
+                if (reply) freeReplyObject(reply);
+            }
+            done(std::move(pending.call), published);
+        }
+        batch.clear();
 
-        std::string request_id = request_data["id"].asString();
-        std::string path = request_data["path"].asString();
-        std::string body = request_data["body"].asString();
+        if (!connection_ok && !redis.connect()) {
+            LOG_ERROR("Redis reconnect failed: %s", redis.errstr());
+        }
+    }
+};
 
-        std::cout << "Processing POST request: " << request_id << " path: " << path << "body:" << body << std::endl;
+// Each worker thread drives up to max_in_flight L2 calls at once through one
+// curl_multi handle: requests are pulled from Redis while there is capacity and
+// completed in whatever order L2 answers them.
+class L2Worker {
+private:
+    // One connection per Redis endpoint for the queue shards, the first is redis
+    std::vector<std::unique_ptr<RedisConnection>> queue_redis;
+    RedisConnection* redis;
+    CURLM* multi;
+    std::string l2_server_url;
+    size_t max_in_flight;
+    CURLSH* curl_share;
+    bool use_http2;
+    AimdLimiter& limiter;
+    struct curl_slist* json_headers = nullptr;
+    std::vector<CURL*> idle_handles;
+    std::unordered_map<CURL*, std::unique_ptr<L2Call>> in_flight;
+
+    // Requests popped from Redis but not started yet, see fetch_batch()
+    std::deque<QueuedMessage> prefetched;
+    // The next request, parsed and with its body at hand, waiting for a limiter slot
+    std::unique_ptr<L2Call> ready_call;
+    size_t prefetch_max;
+    double consume_rate = 0;  // requests per second, moving average
+    size_t consumed = 0;
+    std::chrono::steady_clock::time_point rate_window_start = std::chrono::steady_clock::now();
+
+    // The shard this thread takes requests from first, the others when it is empty
+    const QueueShards& shards;
+    size_t home_shard;
+
+    // Which priority class the next fetch tries first, and how long requests waited
+    const PriorityClasses& classes;
+    WeightedFairScheduler scheduler;
+    const std::vector<prometheus::Histogram*>& queue_wait;
+    std::vector<const char*> fetch_argv;
+    std::vector<size_t> fetch_argvlen;
+
+    // One per shard in reliable queue mode, or with the streams transport
+    std::vector<std::unique_ptr<ReliableQueue>> reliable;
+    std::vector<std::unique_ptr<StreamQueue>> stream;
+
+    ResultPublisher publisher;
+    ResultPublisher::DoneCallback on_published;
 
-        // Call L2 server
-        std::string l2_response = call_l2_server(path, body);
+    static size_t write_callback(void* contents, size_t size, size_t nmemb, std::string* response) {
+        size_t total_size = size * nmemb;
+        response->append((char*)contents, total_size);
+        return total_size;
+    }
 
-        // Prepare response for Redis
-        Json::Value response_data;
-        response_data["status_code"] = 200;
-        response_data["headers"]["Content-Type"] = "application/json";
-
-        Json::Value response_body;
-        response_body["message"] = "Processed by C++ L2 Worker";
-        response_body["language"] = "C++";
-        response_body["request_id"] = request_id;
-        response_body["l2_response"] = l2_response;
+    // Sizes the response buffer once from Content-Length instead of growing it
+    static size_t header_callback(char* buffer, size_t size, size_t nitems, std::string* response) {
+        static const size_t MAX_RESERVE = 64 * 1024 * 1024;
+        size_t total_size = size * nitems;
+        if (total_size > 15 && strncasecmp(buffer, "Content-Length:", 15) == 0) {
+            unsigned long long length = strtoull(buffer + 15, nullptr, 10);
+            if (length > 0 && length <= MAX_RESERVE) {
+                response->reserve(length);
+            }
+        }
+        return total_size;
+    }
+
+    // Creates an easy handle with everything that is the same for all L2 calls;
+    // start_l2_call only sets the per-request options, so handles are never reset
+    CURL* new_easy_handle() {
+        CURL* easy = curl_easy_init();
+        if (!easy) {
+            return nullptr;
+        }
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, header_callback);
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, json_headers);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT, 10L);
+        curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+        if (curl_share) {
+            curl_easy_setopt(easy, CURLOPT_SHARE, curl_share);
+        }
+        if (use_http2) {
+            bool tls = l2_server_url.compare(0, 8, "https://") == 0;
+            curl_easy_setopt(easy, CURLOPT_HTTP_VERSION,
+                             tls ? (long)CURL_HTTP_VERSION_2TLS : (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+            curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+        }
+        return easy;
+    }
+
+public:
+    L2Worker(const std::vector<std::unique_ptr<RedisCluster>>& redis_endpoints, const std::string& server_url,
+             size_t max_calls, size_t max_prefetch, CURLSH* share, bool http2, AimdLimiter& l2_limiter,
+             const QueueShards& queue_shards, size_t shard, std::chrono::milliseconds max_class_wait,
+             const std::vector<prometheus::Histogram*>& wait_histograms)
+        : l2_server_url(server_url), max_in_flight(max_calls ? max_calls : 1),
+          curl_share(share), use_http2(http2), limiter(l2_limiter),
+          prefetch_max(max_prefetch ? max_prefetch : 1),
+          shards(queue_shards), home_shard(shard), classes(queue_shards.classes(shard)),
+          scheduler(queue_shards.classes(shard), max_class_wait), queue_wait(wait_histograms),
+          publisher(*redis_endpoints[0]) {
+        on_published = [this](std::unique_ptr<L2Call> call, bool published) {
+            result_published(std::move(call), published);
+        };
         
+        for (const auto& endpoint : redis_endpoints) {
+            queue_redis.emplace_back(new RedisConnection(*endpoint));
+            if (!queue_redis.back()->connect()) {
+                std::cerr << "Redis connection error: " << queue_redis.back()->errstr() << std::endl;
+                exit(1);
+            }
+        }
+        redis = queue_redis[0].get();
+
+        multi = curl_multi_init();
+        if (!multi) {
+            std::cerr << "CURL initialization failed" << std::endl;
+            exit(1);
+        }
+        json_headers = curl_slist_append(json_headers, "Content-Type: application/json");
+        if (use_http2) {
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+        }
+    }
+
+    ~L2Worker() {
+        for (auto& entry : in_flight) {
+            curl_multi_remove_handle(multi, entry.first);
+            curl_easy_cleanup(entry.first);
+        }
+        for (CURL* easy : idle_handles) {
+            curl_easy_cleanup(easy);
+        }
+        if (multi) {
+            curl_multi_cleanup(multi);
+        }
+        curl_slist_free_all(json_headers);
+    }
+
+    // The connection to the endpoint a queue shard lives on
+    RedisConnection* shard_redis(size_t shard) {
+        return queue_redis[shards.endpoint_of(shard)].get();
+    }
+
+    // Every thread has a processing list, or is a consumer, on every shard, so each
+    // shard is read even with fewer threads than shards
+    void enable_reliable_queue(const std::string& worker_id, std::chrono::milliseconds visibility_timeout) {
+        for (size_t shard = 0; shard < shards.size(); shard++) {
+            reliable.emplace_back(new ReliableQueue(shard_redis(shard), shards.classes(shard), shard, worker_id,
+                                                    visibility_timeout));
+            reliable.back()->start();
+        }
+    }
+
+    void enable_stream_queue(const std::string& group, const std::string& consumer,
+                             std::chrono::milliseconds visibility_timeout) {
+        for (size_t shard = 0; shard < shards.size(); shard++) {
+            stream.emplace_back(new StreamQueue(shard_redis(shard), shards.classes(shard), shard, group, consumer,
+                                                visibility_timeout));
+            stream.back()->start();
+        }
+    }
+
+    // The request is done with, in reliable mode it may now leave the processing
+    // list, with streams it is acknowledged
+    void finish_message(size_t shard, uint64_t seq) {
+        if (!reliable.empty()) {
+            reliable[shard]->ack(seq);
+        } else if (!stream.empty()) {
+            stream[shard]->ack(seq);
+        }
+    }
+
+    // Requests that can never succeed are kept for inspection in reliable mode
+    void reject_message(const std::string& message, size_t shard, uint64_t seq) {
+        if (!reliable.empty()) {
+            reliable[shard]->dead_letter(message);
+        } else if (!stream.empty()) {
+            stream[shard]->dead_letter(message);
+        }
+        finish_message(shard, seq);
+    }
+
+    // Adds the L2 request for call to the multi handle
+    bool start_l2_call(std::unique_ptr<L2Call> call) {
+        CURL* easy = nullptr;
+        if (!idle_handles.empty()) {
+            easy = idle_handles.back();
+            idle_handles.pop_back();
+        } else {
+            easy = new_easy_handle();
+        }
+        if (!easy) {
+            worker_l2_errors_counter.Increment();
+            LOG_ERROR("CURL initialization failed for request %s", call->request_id.c_str());
+            reject_message(call->message, call->shard, call->seq);
+            return false;
+        }
+
+        worker_l2_calls_counter.Increment();
+        call->url = l2_server_url + call->path;
+        call->easy = easy;
+
+        curl_easy_setopt(easy, CURLOPT_URL, call->url.c_str());
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, &call->response);
+        curl_easy_setopt(easy, CURLOPT_HEADERDATA, &call->response);
+
+        // The handle may have been used for either kind of request before
+        if (call->body_len > 0) {
+            curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)call->body_len);
+            curl_easy_setopt(easy, CURLOPT_POSTFIELDS, call->body);
+        } else {
+            curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+        }
+
+        curl_multi_add_handle(multi, easy);
+        in_flight.emplace(easy, std::move(call));
+        return true;
+    }
+
+    // Completes every transfer curl has finished, in the order they finished
+    void collect_l2_results() {
+        int queued = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi, &queued)) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            CURL* easy = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            curl_multi_remove_handle(multi, easy);
+
+            auto it = in_flight.find(easy);
+            if (it == in_flight.end()) {
+                curl_easy_cleanup(easy);
+                continue;
+            }
+            std::unique_ptr<L2Call> call = std::move(it->second);
+            in_flight.erase(it);
+            idle_handles.push_back(easy);
+
+            // Server errors and throttling count as congestion just like timeouts
+            long http_status = 0;
+            curl_off_t total_us = 0;
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &http_status);
+            curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total_us);
+            limiter.release(std::chrono::microseconds(total_us),
+                            res == CURLE_OK && http_status < 500 && http_status != 429);
+
+            if (res != CURLE_OK) {
+                worker_l2_errors_counter.Increment();
+                call->response = "{\"error\": \"Failed to call L2 server: " + std::string(curl_easy_strerror(res)) + "\"}";
+            }
+            complete_request(std::move(call));
+        }
+    }
+
+    void result_published(std::unique_ptr<L2Call> call, bool published) {
+        if (!published) {
+            LOG_ERROR("Failed to publish result for request %s", call->request_id.c_str());
+            if (!stream.empty()) {
+                // Left pending, it is claimed and run again after the visibility timeout
+                stream[call->shard]->release(call->seq);
+                return;
+            }
+            if (!reliable.empty()) {
+                // Let it run again rather than lose it, next and not behind the backlog:
+                // the proxy may still be waiting and the reply list expires after a minute
+                worker_redis_operations_counter.Increment();
+                redisReply* reply = shard_redis(call->shard)->command("LPUSH %s %b",
+                                                                      shards.classes(call->shard).requeue_key().c_str(),
+                                                                      call->message.data(), call->message.size());
+                if (!(reply && reply->type == REDIS_REPLY_INTEGER)) {
+                    worker_redis_errors_counter.Increment();
+                }
+                if (reply) freeReplyObject(reply);
+            }
+        }
+        finish_message(call->shard, call->seq);
+
+        // Whatever is not removed here expires after a minute (see stream_body)
+        if (published && call->request_data.isMember("body_key")) {
+            worker_redis_operations_counter.Increment();
+            redisReply* reply = redis->command("DEL %s", call->request_data["body_key"].asCString());
+            if (!reply) {
+                worker_redis_errors_counter.Increment();
+            }
+            if (reply) freeReplyObject(reply);
+        }
+    }
+
+    // Collects a body the proxy streamed to body_key in chunks. It stays in place
+    // until the request is done with, a redelivered request needs it again.
+    bool fetch_streamed_body(const std::string& body_key, size_t body_length, std::string& body) {
+        worker_redis_operations_counter.Increment();
+        redisReply* chunks = redis->command("LRANGE %s 0 -1", body_key.c_str());
+        bool ok = chunks && chunks->type == REDIS_REPLY_ARRAY;
+        if (ok) {
+            body.clear();
+            body.reserve(body_length);
+            for (size_t i = 0; i < chunks->elements; i++) {
+                body.append(chunks->element[i]->str, chunks->element[i]->len);
+            }
+            ok = body.size() == body_length;
+        } else {
+            worker_redis_errors_counter.Increment();
+        }
+
+        if (chunks) freeReplyObject(chunks);
+        return ok;
+    }
+
+    // Parses a queued request and collects a streamed body, everything its L2 call
+    // needs. Requests that need no call (parse failures, non-POST) are finished
+    // right here and return nullptr.
+    std::unique_ptr<L2Call> prepare_request(QueuedMessage queued) {
+        auto start_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count();
+
+        worker_requests_processed_counter.Increment();
+        worker_bytes_received_counter.Increment(queued.data.size());
+
+        std::unique_ptr<L2Call> call(new L2Call());
+        call->message = std::move(queued.data);
+        call->seq = queued.seq;
+        call->priority = queued.priority;
+        call->shard = queued.shard;
+        call->start_us = start_us;
+
+        if (!parse_envelope(call->message, call->request_data, call->body, call->body_len, call->body_storage)) {
+            LOG_ERROR("Failed to parse JSON request");
+            reject_message(call->message, call->shard, call->seq);
+            return nullptr;
+        }
+        const Json::Value& request_data = call->request_data;
+
+        if (request_data.isMember("body_key")) {
+            if (!fetch_streamed_body(request_data["body_key"].asString(),
+                                     request_data["body_length"].asUInt64(), call->body_storage)) {
+                LOG_ERROR("Failed to fetch streamed body %s", request_data["body_key"].asString().c_str());
+                reject_message(call->message, call->shard, call->seq);
+                return nullptr;
+            }
+            call->body = call->body_storage.data();
+            call->body_len = call->body_storage.size();
+        }
+
+        call->method = request_data["method"].asString();
+        if (call->method != "POST") {
+            LOG_SAMPLED(LogLevel::DEBUG, "Skipping non-POST request: %s", call->method.c_str());
+            finish_message(call->shard, call->seq);
+            return nullptr;
+        }
+
+        call->request_id = request_data["id"].asString();
+        call->path = request_data["path"].asString();
+
+        LOG_SAMPLED(LogLevel::INFO, "Processing POST request: %s path: %s body: %.*s (%zu bytes)",
+                    call->request_id.c_str(), call->path.c_str(),
+                    AsyncLogger::instance().body_preview(call->body_len), call->body, call->body_len);
+
+        // Older proxies do not stamp the envelope, time-ordered ids still tell
+        uint64_t created_ms = request_data.isMember("enqueued_ms")
+            ? request_data["enqueued_ms"].asUInt64()
+            : TimeOrderedIdGenerator::timestamp_ms(call->request_id);
+        if (created_ms) {
+            auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()
+            ).count();
+            long long waited_ms = std::max(0LL, (long long)now_ms - (long long)created_ms);
+            queue_wait[queued.priority]->Observe(waited_ms / 1000.0);
+            LOG_SAMPLED(LogLevel::DEBUG, "Request %s waited %lld ms in queue %s",
+                        call->request_id.c_str(), waited_ms, classes[queued.priority].name.c_str());
+        }
+
+        return call;
+    }
+
+    // Builds the reply for a finished call and queues it on the publisher
+    void complete_request(std::unique_ptr<L2Call> call) {
+        const std::string& request_id = call->request_id;
+        const std::string& l2_response = call->response;
+        auto start_us = call->start_us;
+
         // Получаем timestamp в микросекундах UTC (стандарт для OpenObserve)
         auto now = std::chrono::system_clock::now();
         auto timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
             now.time_since_epoch()
         ).count();
-        response_body["timestamp"] = (Json::Int64)timestamp_us; // ← микросекунды UTC
-
-        response_data["body"] = response_body;
-
-        // Store response in Redis
-        Json::StreamWriterBuilder writer;
-        std::string response_str = Json::writeString(writer, response_data);
-        worker_bytes_sent_counter.Increment(response_str.size());
 
-        worker_redis_operations_counter.Increment();
-        redisReply* reply = (redisReply*)redisCommand(redis, "SETEX http:response:%s 60 %s",
-                                                     request_id.c_str(), response_str.c_str());
-        if (reply && reply->type != REDIS_REPLY_STATUS) {
-            worker_redis_errors_counter.Increment();
+        // Prepare response for Redis:
+        // {"status_code", "headers", "body": {"message", "language", "request_id", "l2_response", "timestamp"}}
+        // A JSON answer from L2 is spliced in as is, anything else is stored as a string
+        std::string response_str;
+        response_str.reserve(l2_response.size() + 256);
+        response_str += "{\"status_code\":200,\"headers\":{\"Content-Type\":\"application/json\"},"
+                        "\"body\":{\"message\":\"Processed by C++ L2 Worker\",\"language\":\"C++\",\"request_id\":";
+        append_json_string(response_str, request_id.data(), request_id.size());
+        response_str += ",\"l2_response\":";
+        if (JsonValidator::valid(l2_response.data(), l2_response.size())) {
+            response_str += l2_response;
+        } else {
+            append_json_string(response_str, l2_response.data(), l2_response.size());
         }
-        if (reply) freeReplyObject(reply);
+        response_str += ",\"timestamp\":";
+        response_str += std::to_string(timestamp_us); // ← микросекунды UTC
+        response_str += "}}";
+        worker_bytes_sent_counter.Increment(response_str.size());
 
         // Send tracing span
 #if defined(USE_OPENTELEMETRY) || defined(USE_JAEGER)
@@ -661,8 +2759,8 @@ public:
 
             nlohmann::json attrs = {
                 {"request.id", request_id},
-                {"request.path", path},
-                {"request.method", method}
+                {"request.path", call->path},
+                {"request.method", call->method}
             };
 
             tracer->send_span(
@@ -677,51 +2775,313 @@ public:
             );
         }
 #endif
+
+        // Store response in Redis, sent with the next publisher flush
+        publisher.publish(std::move(call), response_str);
     }
 
-    void run() {
-        std::cout << "C++ L2 Worker started. Waiting for requests..." << std::endl;
+    // Prefetch enough requests for about 50 ms of work at the rate this thread has
+    // been consuming them, so the round trip is amortized without hoarding work
+    // other threads and replicas could take
+    size_t prefetch_depth() {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - rate_window_start).count();
+        if (elapsed >= 0.1) {
+            consume_rate = 0.8 * consume_rate + 0.2 * (consumed / elapsed);
+            consumed = 0;
+            rate_window_start = now;
+        }
+        size_t depth = (size_t)(consume_rate * 0.05);
+        return std::max<size_t>(1, std::min(depth, prefetch_max));
+    }
 
-        while (!shutdown_flag) {
-            worker_redis_operations_counter.Increment();
-            redisReply* reply = (redisReply*)redisCommand(redis, "BLPOP http:requests 10");
+    // Takes up to prefetch_depth() requests of one priority class, the first non-empty
+    // one in the scheduler's order. Blocks for up to a second only when asked to,
+    // otherwise returns false right away if every queue is empty.
+    // With several shards the home shard is tried first, then the others in turn
+    // (work stealing), and only then does the thread block on the home shard, for
+    // 100 ms so the others are looked at again soon.
+    bool fetch_batch(bool block) {
+        const std::vector<size_t>& order = scheduler.order();
+        bool sharded = shards.size() > 1;
+        long long block_ms = !block ? 0 : sharded ? 100 : 1000;
+        size_t fetched = fetch_from(home_shard, sharded ? 0 : block_ms, order);
+        for (size_t i = 1; !fetched && i < shards.size(); i++) {
+            fetched = fetch_from((home_shard + i) % shards.size(), 0, order);
+        }
+        if (!fetched && block && sharded) {
+            fetched = fetch_from(home_shard, block_ms, order);
+        }
+        if (fetched) {
+            scheduler.served(prefetched.back().priority);
+        }
+        return count_reads(fetched) > 0;
+    }
 
-            if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2) {
-                std::string request_json = reply->element[1]->str;
-                process_request(request_json);
-                // Increment read counter
-                worker_redis_operations_counter.Increment();
-                redisReply* incr_reply = (redisReply*)redisCommand(redis, "INCR stats:redis_reads");
-                if (!(incr_reply && incr_reply->type == REDIS_REPLY_INTEGER)) {
-                    worker_redis_errors_counter.Increment();
-                }
-                if (incr_reply) freeReplyObject(incr_reply);
-            } else if (reply && reply->type != REDIS_REPLY_ARRAY) {
-                worker_redis_errors_counter.Increment();
+    // One fetch from a shard with the transport in use, waiting up to block_ms if set
+    size_t fetch_from(size_t shard, long long block_ms, const std::vector<size_t>& order) {
+        if (!reliable.empty()) {
+            return reliable[shard]->fetch(prefetched, prefetch_depth(), block_ms, order);
+        }
+        if (!stream.empty()) {
+            return stream[shard]->fetch(prefetched, prefetch_depth(), block_ms, order);
+        }
+        return pop_batch(shard, block_ms > 0, order);
+    }
+
+    size_t pop_batch(size_t shard, bool block, const std::vector<size_t>& order) {
+        const PriorityClasses& shard_classes = shards.classes(shard);
+        std::string count = std::to_string(prefetch_depth());
+        std::string numkeys = std::to_string(order.size());
+        fetch_argv.clear();
+        fetch_argvlen.clear();
+        auto arg = [this](const std::string& value) {
+            fetch_argv.push_back(value.data());
+            fetch_argvlen.push_back(value.size());
+        };
+        static const std::string blmpop = "BLMPOP", lmpop = "LMPOP", timeout = "1", short_timeout = "0.1",
+                                 left = "LEFT", count_arg = "COUNT";
+        arg(block ? blmpop : lmpop);
+        if (block) {
+            arg(shards.size() > 1 ? short_timeout : timeout);
+        }
+        arg(numkeys);
+        for (size_t priority : order) {
+            arg(shard_classes[priority].key);
+        }
+        arg(left);
+        arg(count_arg);
+        arg(count);
+
+        worker_redis_operations_counter.Increment();
+        redisReply* reply = shard_redis(shard)->command_argv(fetch_argv.size(), fetch_argv.data(),
+                                                             fetch_argvlen.data());
+
+        size_t fetched = 0;
+        int priority = -1;
+        if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2
+            && reply->element[0]->type == REDIS_REPLY_STRING && reply->element[1]->type == REDIS_REPLY_ARRAY) {
+            priority = shard_classes.find_key(reply->element[0]->str, reply->element[0]->len);
+        }
+        if (priority >= 0) {
+            redisReply* items = reply->element[1];
+            for (size_t i = 0; i < items->elements; i++) {
+                prefetched.push_back(QueuedMessage{std::string(items->element[i]->str, items->element[i]->len),
+                                                   0, (size_t)priority, shard});
             }
+            fetched = items->elements;
+        } else if (!reply || reply->type != REDIS_REPLY_NIL) {
+            worker_redis_errors_counter.Increment();
+        }
+        if (reply) freeReplyObject(reply);
+        return fetched;
+    }
+
+    size_t count_reads(size_t fetched) {
+        // Increment read counter, flushed to Redis by the StatsFlusher
+        stats_redis_reads.add(fetched);
+        return fetched;
+    }
+
+    QueuedMessage next_message() {
+        QueuedMessage message = std::move(prefetched.front());
+        prefetched.pop_front();
+        consumed++;
+        return message;
+    }
 
+    // Puts requests that were prefetched but never started back at the head of the queue
+    void requeue_prefetched() {
+        if (ready_call) {
+            QueuedMessage queued;
+            queued.data = std::move(ready_call->message);
+            queued.seq = ready_call->seq;
+            queued.priority = ready_call->priority;
+            queued.shard = ready_call->shard;
+            prefetched.push_front(std::move(queued));
+            ready_call.reset();
+        }
+        if (!reliable.empty()) {
+            // They are still in the processing lists, which stop() requeues as a whole
+            prefetched.clear();
+            for (auto& queue : reliable) {
+                queue->stop();
+            }
+            return;
+        }
+        if (!stream.empty()) {
+            // Still pending in the consumer group, see StreamQueue::stop()
+            prefetched.clear();
+            for (auto& queue : stream) {
+                queue->stop();
+            }
+            return;
+        }
+        while (!prefetched.empty()) {
+            const QueuedMessage& queued = prefetched.back();
+            const std::string& message = queued.data;
+            const std::string& queue_key = shards.classes(queued.shard)[queued.priority].key;
+            worker_redis_operations_counter.Increment();
+            redisReply* reply = shard_redis(queued.shard)->command("LPUSH %s %b", queue_key.c_str(),
+                                                                   message.data(), message.size());
+            if (!(reply && reply->type == REDIS_REPLY_INTEGER)) {
+                worker_redis_errors_counter.Increment();
+            }
             if (reply) freeReplyObject(reply);
-            // std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            prefetched.pop_back();
         }
+    }
+
+    void run() {
+        // On shutdown stop taking new requests but finish the ones in flight
+        while (!shutdown_flag || !in_flight.empty()) {
+            for (auto& queue : reliable) {
+                queue->maintain();
+            }
+            for (auto& queue : stream) {
+                count_reads(queue->maintain(prefetched));
+            }
+            // Every L2 call needs a slot from the process-wide adaptive limit. The slot
+            // is taken once the request is ready to go: fetching may block for a
+            // second and a streamed body takes a round trip, neither belongs to L2.
+            bool throttled = false;
+            while (!shutdown_flag && in_flight.size() < max_in_flight) {
+                if (!ready_call) {
+                    if (prefetched.empty() && !fetch_batch(in_flight.empty())) {
+                        break;
+                    }
+                    ready_call = prepare_request(next_message());
+                    continue;
+                }
+                if (!limiter.try_acquire()) {
+                    throttled = true;
+                    break;
+                }
+                // Call L2 server, complete_request() runs once it has answered
+                if (!start_l2_call(std::move(ready_call))) {
+                    limiter.cancel();
+                }
+            }
+            if (in_flight.empty()) {
+                if (throttled) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                continue;
+            }
 
-        std::cout << "Shutting down gracefully..." << std::endl;
+            int running = 0;
+            curl_multi_perform(multi, &running);
+            collect_l2_results();
+            publisher.flush(on_published);
+
+            // With spare capacity come back soon to look for new requests
+            int timeout_ms = in_flight.size() < max_in_flight ? 5 : 100;
+            curl_multi_poll(multi, nullptr, 0, timeout_ms, nullptr);
+        }
+        requeue_prefetched();
     }
 };
 
 void run_worker() {
 
-    std::string redis_host = "valkey";
-    int redis_port = 6379;
+    std::vector<std::unique_ptr<RedisCluster>> redis_endpoints = redis_endpoints_from_env();
+    PriorityClasses priority_classes(get_env_string(PRIORITY_CLASSES_ENV, ""), get_env_string(PRIORITY_DEFAULT_ENV, ""));
+    QueueShards shards(redis_endpoints.size(), std::max(1LL, get_env_int(QUEUE_SHARDS_ENV, 1)),
+                       QueueShards::strategy_from_string(get_env_string(SHARD_STRATEGY_ENV, "round_robin")),
+                       priority_classes, redis_endpoints[0]->enabled());
     std::string l2_server_url = "http://l2-server:3000";
 
     // Start Prometheus exposer
     prometheus::Exposer exposer{"0.0.0.0:9091"};
     exposer.RegisterCollectable(worker_registry);
 
-    L2Worker worker(redis_host, redis_port, l2_server_url);
+    // curl_global_init is not thread-safe, do it before any thread creates a handle
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    int num_threads = std::max(1LL, get_env_int(WORKER_THREADS_ENV, 4));
+    size_t max_in_flight = std::max(1LL, get_env_int(L2_MAX_IN_FLIGHT_ENV, 64));
+    size_t prefetch_max = std::max(1LL, get_env_int(WORKER_PREFETCH_MAX_ENV, 128));
+    bool l2_http2 = get_env_bool(L2_HTTP2_ENV, false);
+
+    // Starts low and finds what L2 can take, up to everything the threads could run
+    AimdLimiter l2_limiter(get_env_int(L2_LIMIT_INITIAL_ENV, 16),
+                           get_env_int(L2_LIMIT_MIN_ENV, 1),
+                           get_env_int(L2_LIMIT_MAX_ENV, num_threads * (long long)max_in_flight),
+                           worker_l2_concurrency_limit_gauge);
+
+    bool stream_transport = get_env_string(QUEUE_TRANSPORT_ENV, "list") == "stream";
+    std::string stream_group = get_env_string(STREAM_GROUP_ENV, "l2-workers");
+    // Streams track pending entries themselves, the processing lists are for the list transport
+    bool reliable_queue = get_env_bool(RELIABLE_QUEUE_ENV, false) && !stream_transport;
+    std::chrono::milliseconds visibility_timeout(std::max(1000LL, get_env_int(VISIBILITY_TIMEOUT_MS_ENV, 30000)));
+    // Must be unique per worker process and stable across restarts to recover its own lists
+    std::string worker_id = get_env_string(WORKER_ID_ENV, "");
+    if (worker_id.empty()) {
+        char hostname[256] = {0};
+        gethostname(hostname, sizeof(hostname) - 1);
+        worker_id = hostname;
+    }
+
+    // Threads start on consecutive shards, so replicas with different ids spread out
+    size_t shard_offset = std::max(0LL, get_env_int(WORKER_SHARD_OFFSET_ENV, QueueShards::fnv1a(worker_id) % shards.size()));
+
+    std::chrono::milliseconds max_class_wait(std::max(1LL, get_env_int(PRIORITY_MAX_WAIT_MS_ENV, 1000)));
+    std::vector<prometheus::Gauge*> depth_gauges;
+    std::vector<prometheus::Histogram*> wait_histograms;
+    for (size_t i = 0; i < priority_classes.size(); i++) {
+        depth_gauges.push_back(&l2_worker_queue_depth.Add({{"priority", priority_classes[i].name}}));
+        wait_histograms.push_back(&l2_worker_queue_wait_seconds.Add({{"priority", priority_classes[i].name}},
+                                                                    QUEUE_WAIT_BUCKETS));
+    }
+
+    // Outlives the workers, their easy handles use it
+    CurlShare curl_share;
+
+    RedisPool stats_pool(*redis_endpoints[0], 1, std::chrono::milliseconds(30000));
+    StatsFlusher stats_flusher(stats_pool, {&stats_redis_reads},
+                               std::chrono::milliseconds(std::max(10LL, get_env_int(STATS_FLUSH_MS_ENV, 1000))),
+                               worker_redis_operations_counter, worker_redis_errors_counter);
+    // The depth of a class is summed over every shard, on whichever endpoint it lives
+    std::vector<std::unique_ptr<RedisPool>> endpoint_pools;
+    std::vector<RedisPool*> sample_pools;
+    std::vector<const PriorityClasses*> sample_classes;
+    for (size_t i = 1; i < shards.endpoint_count(); i++) {
+        endpoint_pools.emplace_back(new RedisPool(*redis_endpoints[i], 1, std::chrono::milliseconds(30000)));
+    }
+    for (size_t shard = 0; shard < shards.size(); shard++) {
+        size_t endpoint = shards.endpoint_of(shard);
+        sample_pools.push_back(endpoint == 0 ? &stats_pool : endpoint_pools[endpoint - 1].get());
+        sample_classes.push_back(&shards.classes(shard));
+    }
+    QueueDepthSampler depth_sampler(sample_pools, sample_classes, stream_transport ? stream_group : "", depth_gauges,
+                                    std::chrono::milliseconds(std::max(100LL, get_env_int(QUEUE_DEPTH_SAMPLE_MS_ENV, 1000))),
+                                    worker_redis_operations_counter, worker_redis_errors_counter);
+
+    // Connect everything up front so a bad configuration fails at startup
+    std::vector<std::unique_ptr<L2Worker>> workers;
+    for (int i = 0; i < num_threads; i++) {
+        workers.emplace_back(new L2Worker(redis_endpoints, l2_server_url, max_in_flight, prefetch_max,
+                                          curl_share.get(), l2_http2, l2_limiter,
+                                          shards, (shard_offset + i) % shards.size(), max_class_wait, wait_histograms));
+        if (stream_transport) {
+            workers.back()->enable_stream_queue(stream_group, worker_id + ":" + std::to_string(i), visibility_timeout);
+        } else if (reliable_queue) {
+            workers.back()->enable_reliable_queue(worker_id + ":" + std::to_string(i), visibility_timeout);
+        }
+    }
 
     std::cout << "C++ L2 Worker Prometheus metrics available at http://0.0.0.0:9091/metrics" << std::endl;
-    worker.run();
+    std::cout << "C++ L2 Worker started with " << num_threads << " threads. Waiting for requests..." << std::endl;
+
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker] { worker->run(); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::cout << "Shutting down gracefully..." << std::endl;
 }
 
 void signal_handler(int signum) {
@@ -733,6 +3093,12 @@ int main() {
     std::signal(SIGTERM, signal_handler);
     std::signal(SIGINT, signal_handler);
 
+    AsyncLogger::instance().configure(
+        AsyncLogger::level_from_string(get_env_string(LOG_LEVEL_ENV, "info")),
+        std::max(1LL, get_env_int(LOG_SAMPLE_RATE_ENV, 1)),
+        std::max(0LL, get_env_int(LOG_BODY_MAX_ENV, 256))
+    );
+
     // Initialize Tracer
 #if defined(USE_OPENTELEMETRY) || defined(USE_JAEGER)
     init_tracer();
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+
+// Intrusive multi-producer / single-consumer queue (D. Vyukov).
+// push() is a single atomic exchange and never blocks, pop() may only be called
+// from one consumer thread. T must be default constructible and expose
+// std::atomic<T*> next.
+template <typename T>
+class MpscQueue {
+private:
+    std::atomic<T*> head;
+    T* tail;
+    T stub;
+
+public:
+    MpscQueue() : head(&stub), tail(&stub) {
+        stub.next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T* node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        T* prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // Returns nullptr when the queue is empty or a producer is half way through push()
+    T* pop() {
+        T* node = tail;
+        T* next = node->next.load(std::memory_order_acquire);
+        if (node == &stub) {
+            if (!next) {
+                return nullptr;
+            }
+            tail = next;
+            node = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            tail = next;
+            return node;
+        }
+        if (node != head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        push(&stub);
+        next = node->next.load(std::memory_order_acquire);
+        if (next) {
+            tail = next;
+            return node;
+        }
+        return nullptr;
+    }
+
+    // Consumer side only. A push that is still in progress may be reported as empty.
+    bool empty() const {
+        return tail == &stub && stub.next.load(std::memory_order_acquire) == nullptr;
+    }
+};
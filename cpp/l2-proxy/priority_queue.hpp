@@ -0,0 +1,324 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <prometheus/counter.h>
+#include <prometheus/gauge.h>
+#include "redis_pool.hpp"
+
+// Priority classes of the request queue, each a Redis list of its own.
+//
+// Configured as "name:weight" entries separated by ',' in order of precedence, e.g.
+//
+//     high:8,normal:4,low:1
+//
+// and queued on http:requests:<name>, or on the stream <key>:stream with the
+// streams transport. Without a configuration there is a single class on
+// http:requests, as before. The weight is the share of fetches a class gets from
+// the workers while every class has work (see WeightedFairScheduler).
+class PriorityClasses {
+public:
+    struct Class {
+        std::string name;
+        std::string key;
+        std::string stream_key;
+        int weight = 1;
+    };
+
+    static constexpr const char* BASE_KEY = "http:requests";
+
+    PriorityClasses(const std::string& config, const std::string& default_name) {
+        std::stringstream entries(config);
+        std::string entry;
+        while (std::getline(entries, entry, ',')) {
+            entry.erase(0, entry.find_first_not_of(" \t"));
+            entry.erase(entry.find_last_not_of(" \t") + 1);
+            if (entry.empty()) {
+                continue;
+            }
+            Class priority;
+            size_t colon = entry.find(':');
+            priority.name = entry.substr(0, colon);
+            if (colon != std::string::npos) {
+                priority.weight = atoi(entry.c_str() + colon + 1);
+            }
+            // "dead" would collide with the dead letter list http:requests:dead
+            if (priority.name.empty() || priority.name == "dead" || priority.weight < 1 || find(priority.name) >= 0) {
+                std::cerr << "Ignoring invalid priority class: " << entry << std::endl;
+                continue;
+            }
+            priority.key = std::string(BASE_KEY) + ":" + priority.name;
+            priority.stream_key = priority.key + ":stream";
+            classes.push_back(priority);
+        }
+
+        if (classes.empty()) {
+            Class single;
+            single.name = "default";
+            single.key = BASE_KEY;
+            single.stream_key = single.key + ":stream";
+            classes.push_back(single);
+        }
+
+        // Unclassified requests go to the named class, or the last one
+        int index = find(default_name);
+        default_class = index >= 0 ? index : classes.size() - 1;
+    }
+
+    // The same classes on the keys of one queue shard, <key>:{shard} (see QueueShards)
+    PriorityClasses(const PriorityClasses& base, size_t shard)
+        : classes(base.classes), default_class(base.default_class), key_tag(":{" + std::to_string(shard) + "}") {
+        for (Class& priority : classes) {
+            priority.key += key_tag;
+            priority.stream_key = priority.key + ":stream";
+        }
+    }
+
+    size_t size() const {
+        return classes.size();
+    }
+
+    const Class& operator[](size_t index) const {
+        return classes[index];
+    }
+
+    size_t default_index() const {
+        return default_class;
+    }
+
+    // The suffix of a shard's keys, for keys that have to share their slot
+    const std::string& tag() const {
+        return key_tag;
+    }
+
+    // Requests that go back to the queue after they were taken once (a dead
+    // worker's processing list, a failed publish) have waited already
+    const std::string& requeue_key() const {
+        return classes.front().key;
+    }
+
+    int find(const std::string& name) const {
+        for (size_t i = 0; i < classes.size(); i++) {
+            if (classes[i].name == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int find_key(const char* key, size_t len) const {
+        for (size_t i = 0; i < classes.size(); i++) {
+            if (classes[i].key.compare(0, std::string::npos, key, len) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int find_stream_key(const char* key, size_t len) const {
+        for (size_t i = 0; i < classes.size(); i++) {
+            if (classes[i].stream_key.compare(0, std::string::npos, key, len) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+private:
+    std::vector<Class> classes;
+    size_t default_class = 0;
+    std::string key_tag;
+};
+
+// Decides in which order a worker thread looks at the priority classes. Smooth
+// weighted round robin: every round each class earns its weight in credit, the
+// class a batch came from pays the total weight, and classes are tried from the
+// most credit down. The first non-empty class in that order is served, so idle
+// classes cost nothing, and credit is capped so a class that was idle for a while
+// cannot claim a long run of fetches afterwards.
+// A class that has not been served for max_wait goes first regardless of credit,
+// which bounds how long a low weight class can wait behind a busy high one.
+// Weights count fetches, i.e. prefetch batches, not single requests.
+class WeightedFairScheduler {
+private:
+    const PriorityClasses& classes;
+    std::chrono::milliseconds max_wait;
+    long total_weight = 0;
+    std::vector<long> credit;
+    std::vector<std::chrono::steady_clock::time_point> last_served;
+    std::vector<size_t> fetch_order;
+
+public:
+    WeightedFairScheduler(const PriorityClasses& priority_classes, std::chrono::milliseconds starvation_limit)
+        : classes(priority_classes), max_wait(starvation_limit),
+          credit(priority_classes.size(), 0),
+          last_served(priority_classes.size(), std::chrono::steady_clock::now()) {
+        for (size_t i = 0; i < classes.size(); i++) {
+            total_weight += classes[i].weight;
+            fetch_order.push_back(i);
+        }
+    }
+
+    // Classes in the order the next fetch should try them
+    const std::vector<size_t>& order() {
+        if (classes.size() == 1) {
+            return fetch_order;
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < classes.size(); i++) {
+            credit[i] = std::min(credit[i] + classes[i].weight, total_weight);
+        }
+        std::sort(fetch_order.begin(), fetch_order.end(), [&](size_t a, size_t b) {
+            bool a_starving = now - last_served[a] >= max_wait;
+            bool b_starving = now - last_served[b] >= max_wait;
+            if (a_starving != b_starving) {
+                return a_starving;
+            }
+            if (a_starving) {
+                return last_served[a] < last_served[b];
+            }
+            if (credit[a] != credit[b]) {
+                return credit[a] > credit[b];
+            }
+            return a < b;
+        });
+        return fetch_order;
+    }
+
+    void served(size_t index) {
+        credit[index] = std::max(credit[index] - total_weight, -total_weight);
+        last_served[index] = std::chrono::steady_clock::now();
+    }
+};
+
+// Publishes the length of every priority list to a gauge, with one pipelined round
+// of LLEN every interval. For streams the depth is the consumer group's lag, the
+// entries not delivered to any consumer yet (XINFO GROUPS). With a sharded queue
+// the lengths of a class are summed over the shards, one round per shard.
+class QueueDepthSampler {
+private:
+    std::vector<RedisPool*> redis_pools;                 // per shard
+    std::vector<const PriorityClasses*> shard_classes;   // per shard
+    std::string stream_group;  // empty for lists
+    std::vector<prometheus::Gauge*> depth_gauges;
+    std::chrono::milliseconds interval;
+    prometheus::Counter& requests_counter;
+    prometheus::Counter& errors_counter;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread sampler;
+
+    void sample() {
+        std::vector<long long> depths(depth_gauges.size(), 0);
+        for (size_t shard = 0; shard < redis_pools.size(); shard++) {
+            if (!sample_shard(*redis_pools[shard], *shard_classes[shard], depths)) {
+                return;
+            }
+        }
+        for (size_t i = 0; i < depth_gauges.size(); i++) {
+            depth_gauges[i]->Set(depths[i]);
+        }
+    }
+
+    bool sample_shard(RedisPool& redis_pool, const PriorityClasses& classes, std::vector<long long>& depths) {
+        RedisPool::Lease redis = redis_pool.acquire(std::chrono::milliseconds(1000));
+        if (!redis) {
+            errors_counter.Increment();
+            return false;
+        }
+        for (size_t i = 0; i < classes.size(); i++) {
+            if (stream_group.empty()) {
+                redis->append("LLEN %s", classes[i].key.c_str());
+            } else {
+                redis->append("XINFO GROUPS %s", classes[i].stream_key.c_str());
+            }
+        }
+        requests_counter.Increment(classes.size());
+        for (size_t i = 0; i < classes.size(); i++) {
+            redisReply* reply = nullptr;
+            if (redis->get_reply(&reply) != REDIS_OK || !reply) {
+                errors_counter.Increment();
+                return false;
+            }
+            if (reply->type == REDIS_REPLY_INTEGER) {
+                depths[i] += reply->integer;
+            } else if (reply->type == REDIS_REPLY_ARRAY) {
+                depths[i] += group_lag(reply);
+            } else if (reply->type != REDIS_REPLY_ERROR || stream_group.empty()) {
+                // XINFO fails for a stream nothing was written to yet, that is fine
+                errors_counter.Increment();
+            }
+            freeReplyObject(reply);
+        }
+        return true;
+    }
+
+    // Every group is a flat field/value array; lag is nil when Valkey cannot tell
+    long long group_lag(const redisReply* groups) const {
+        for (size_t g = 0; g < groups->elements; g++) {
+            const redisReply* group = groups->element[g];
+            if (group->type != REDIS_REPLY_ARRAY) {
+                continue;
+            }
+            bool ours = false;
+            long long lag = 0;
+            for (size_t f = 0; f + 1 < group->elements; f += 2) {
+                const redisReply* field = group->element[f];
+                const redisReply* value = group->element[f + 1];
+                if (field->type != REDIS_REPLY_STRING) {
+                    continue;
+                }
+                std::string name(field->str, field->len);
+                if (name == "name" && value->type == REDIS_REPLY_STRING) {
+                    ours = stream_group.compare(0, std::string::npos, value->str, value->len) == 0;
+                } else if (name == "lag" && value->type == REDIS_REPLY_INTEGER) {
+                    lag = value->integer;
+                }
+            }
+            if (ours) {
+                return lag;
+            }
+        }
+        return 0;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            lock.unlock();
+            sample();
+            lock.lock();
+            cv.wait_for(lock, interval, [this] { return stopping; });
+        }
+    }
+
+public:
+    QueueDepthSampler(std::vector<RedisPool*> pools, std::vector<const PriorityClasses*> classes,
+                      const std::string& group, std::vector<prometheus::Gauge*> gauges,
+                      std::chrono::milliseconds sample_interval,
+                      prometheus::Counter& redis_requests, prometheus::Counter& redis_errors)
+        : redis_pools(std::move(pools)), shard_classes(std::move(classes)), stream_group(group),
+          depth_gauges(std::move(gauges)),
+          interval(sample_interval),
+          requests_counter(redis_requests), errors_counter(redis_errors) {
+        sampler = std::thread([this] { run(); });
+    }
+
+    ~QueueDepthSampler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        sampler.join();
+    }
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "priority_queue.hpp"
+
+// The request queue split into shards, spread over one or more Redis endpoints.
+//
+// Shard i lives on endpoint i % endpoints (the first endpoint also holds everything
+// that is not a queue: request ids, bodies, replies, stats) and queues on
+// <class key>:{i}. The braces make the shard number the hash tag, so in a Redis
+// Cluster all classes of a shard share a slot and one LMPOP or XREADGROUP can span
+// them; with hash_tags set the keys are tagged even for a single shard. Otherwise a
+// single shard keeps the keys as they were. The proxy picks a shard per request,
+// round robin or by a hash of the path, which keeps requests to one path in order.
+class QueueShards {
+public:
+    enum class Strategy {
+        ROUND_ROBIN,
+        PATH_HASH
+    };
+
+    QueueShards(size_t endpoints, size_t shard_count, Strategy shard_strategy, const PriorityClasses& classes,
+                bool hash_tags)
+        : endpoints_count(endpoints ? endpoints : 1), strategy(shard_strategy) {
+        if (shard_count <= 1 && !hash_tags) {
+            shard_classes.push_back(classes);
+        } else {
+            for (size_t shard = 0; shard < std::max<size_t>(shard_count, 1); shard++) {
+                shard_classes.emplace_back(classes, shard);
+            }
+        }
+    }
+
+    static Strategy strategy_from_string(const std::string& name) {
+        return name == "hash" ? Strategy::PATH_HASH : Strategy::ROUND_ROBIN;
+    }
+
+    size_t size() const {
+        return shard_classes.size();
+    }
+
+    size_t endpoint_count() const {
+        return endpoints_count;
+    }
+
+    size_t endpoint_of(size_t shard) const {
+        return shard % endpoints_count;
+    }
+
+    // The priority classes with the keys of one shard
+    const PriorityClasses& classes(size_t shard) const {
+        return shard_classes[shard];
+    }
+
+    size_t pick(const std::string& path) {
+        if (shard_classes.size() == 1) {
+            return 0;
+        }
+        if (strategy == Strategy::PATH_HASH) {
+            return fnv1a(path) % shard_classes.size();
+        }
+        return next_shard.fetch_add(1, std::memory_order_relaxed) % shard_classes.size();
+    }
+
+    // Stable across processes and restarts, unlike std::hash
+    static uint32_t fnv1a(const std::string& value) {
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : value) {
+            hash ^= c;
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+private:
+    size_t endpoints_count;
+    std::vector<PriorityClasses> shard_classes;
+    Strategy strategy;
+    std::atomic<size_t> next_shard{0};
+};
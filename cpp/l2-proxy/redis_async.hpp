@@ -0,0 +1,284 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include "mpsc_queue.hpp"
+
+// One Redis connection driven by its own I/O thread through the hiredis async API,
+// so any number of commands can be in flight on the socket while the threads that
+// issue them carry on. command() formats the command on the calling thread and
+// hands it to the I/O thread through a lock-free queue; the callback runs on the
+// I/O thread once the reply is in, and must not block. The reply is freed when the
+// callback returns. Every callback is called exactly once: with nullptr if the
+// command could not be sent or the connection dropped before its reply arrived.
+// The connection is reestablished in the background after RECONNECT_DELAY.
+class AsyncRedis {
+public:
+    using Callback = std::function<void(redisReply* reply)>;
+
+private:
+    static constexpr std::chrono::milliseconds RECONNECT_DELAY{100};
+    static constexpr std::chrono::milliseconds STOP_TIMEOUT{1000};
+
+    struct Command {
+        std::atomic<Command*> next{nullptr};
+        char* formatted = nullptr;
+        size_t len = 0;
+        Callback callback;
+
+        ~Command() {
+            if (formatted) {
+                redisFreeCommand(formatted);
+            }
+        }
+    };
+
+    std::string redis_host;
+    int redis_port;
+
+    MpscQueue<Command> queue;
+    std::atomic<bool> wake_pending{false};
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> is_connected{false};
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::thread io_thread;
+
+    // Only touched by the I/O thread
+    redisAsyncContext* ac = nullptr;
+    int registered_fd = -1;
+    bool want_read = false;
+    bool want_write = false;
+    size_t pending = 0;
+    std::chrono::steady_clock::time_point reconnect_at;
+
+    // Minimal epoll adapter: hiredis says which events it wants on its socket
+    void update_events() {
+        int fd = ac ? ac->c.fd : -1;
+        if (registered_fd >= 0 && (fd != registered_fd || (!want_read && !want_write))) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, registered_fd, nullptr);
+            registered_fd = -1;
+        }
+        if (fd < 0 || (!want_read && !want_write)) {
+            return;
+        }
+        struct epoll_event event = {};
+        event.events = (want_read ? uint32_t(EPOLLIN) : 0u) | (want_write ? uint32_t(EPOLLOUT) : 0u);
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, registered_fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+        registered_fd = fd;
+    }
+
+    static void add_read(void* privdata) {
+        AsyncRedis* self = static_cast<AsyncRedis*>(privdata);
+        self->want_read = true;
+        self->update_events();
+    }
+
+    static void del_read(void* privdata) {
+        AsyncRedis* self = static_cast<AsyncRedis*>(privdata);
+        self->want_read = false;
+        self->update_events();
+    }
+
+    static void add_write(void* privdata) {
+        AsyncRedis* self = static_cast<AsyncRedis*>(privdata);
+        self->want_write = true;
+        self->update_events();
+    }
+
+    static void del_write(void* privdata) {
+        AsyncRedis* self = static_cast<AsyncRedis*>(privdata);
+        self->want_write = false;
+        self->update_events();
+    }
+
+    static void cleanup(void* privdata) {
+        AsyncRedis* self = static_cast<AsyncRedis*>(privdata);
+        self->want_read = false;
+        self->want_write = false;
+        self->update_events();
+    }
+
+    // hiredis frees the context after either of these, so it must not be used again
+    static void on_connect(const redisAsyncContext* context, int status) {
+        AsyncRedis* self = static_cast<AsyncRedis*>(context->data);
+        if (status != REDIS_OK) {
+            std::cerr << "Redis async connection error: " << context->errstr << std::endl;
+            self->connection_lost();
+            return;
+        }
+        self->is_connected = true;
+    }
+
+    static void on_disconnect(const redisAsyncContext* context, int status) {
+        AsyncRedis* self = static_cast<AsyncRedis*>(context->data);
+        if (status != REDIS_OK) {
+            std::cerr << "Redis async connection lost: " << context->errstr << std::endl;
+        }
+        self->connection_lost();
+    }
+
+    static void on_reply(redisAsyncContext* context, void* reply, void* privdata) {
+        AsyncRedis* self = static_cast<AsyncRedis*>(context->data);
+        Command* sent = static_cast<Command*>(privdata);
+        sent->callback(static_cast<redisReply*>(reply));
+        delete sent;
+        self->pending--;
+    }
+
+    void connection_lost() {
+        ac = nullptr;
+        is_connected = false;
+        want_read = false;
+        want_write = false;
+        update_events();
+        reconnect_at = std::chrono::steady_clock::now() + RECONNECT_DELAY;
+    }
+
+    void connect() {
+        ac = redisAsyncConnect(redis_host.c_str(), redis_port);
+        if (!ac || ac->err) {
+            std::cerr << "Redis async connection error: " << (ac ? ac->errstr : "can't allocate redis context") << std::endl;
+            if (ac) {
+                redisAsyncFree(ac);
+            }
+            connection_lost();
+            return;
+        }
+        ac->data = this;
+        ac->ev.data = this;
+        ac->ev.addRead = add_read;
+        ac->ev.delRead = del_read;
+        ac->ev.addWrite = add_write;
+        ac->ev.delWrite = del_write;
+        ac->ev.cleanup = cleanup;
+        redisAsyncSetDisconnectCallback(ac, on_disconnect);
+        // Has to come after the adapter, it waits for the socket to become writable
+        redisAsyncSetConnectCallback(ac, on_connect);
+    }
+
+    // Sends everything submitted since the last round, or fails it without a connection
+    void drain() {
+        wake_pending.store(false);
+        while (Command* queued = queue.pop()) {
+            if (ac && redisAsyncFormattedCommand(ac, on_reply, queued, queued->formatted, queued->len) == REDIS_OK) {
+                pending++;
+                continue;
+            }
+            queued->callback(nullptr);
+            delete queued;
+        }
+    }
+
+    // One eventfd write per wakeup of the I/O thread, not per command
+    void wake() {
+        if (!wake_pending.exchange(true)) {
+            uint64_t one = 1;
+            ssize_t ignored = write(wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+
+    void run() {
+        connect();
+        struct epoll_event events[16];
+        std::chrono::steady_clock::time_point stop_deadline = std::chrono::steady_clock::time_point::max();
+
+        while (true) {
+            if (stopping && stop_deadline == std::chrono::steady_clock::time_point::max()) {
+                stop_deadline = std::chrono::steady_clock::now() + STOP_TIMEOUT;
+            }
+            // On shutdown, wait for the replies still outstanding
+            if (stopping && ((pending == 0 && queue.empty()) || std::chrono::steady_clock::now() >= stop_deadline)) {
+                break;
+            }
+
+            int ready = epoll_wait(epoll_fd, events, 16, 100);
+            for (int i = 0; i < ready; i++) {
+                if (events[i].data.fd == wake_fd) {
+                    uint64_t count;
+                    ssize_t ignored = read(wake_fd, &count, sizeof(count));
+                    (void)ignored;
+                    continue;
+                }
+                if (!ac || events[i].data.fd != ac->c.fd) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                    redisAsyncHandleRead(ac);
+                }
+                // The read may have dropped the connection
+                if (ac && events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                    redisAsyncHandleWrite(ac);
+                }
+            }
+            drain();
+
+            if (!ac && !stopping && std::chrono::steady_clock::now() >= reconnect_at) {
+                connect();
+            }
+        }
+
+        // Replies that did not arrive in time get nullptr
+        if (ac) {
+            redisAsyncContext* context = ac;
+            redisAsyncFree(context);
+            connection_lost();
+        }
+        drain();
+    }
+
+public:
+    AsyncRedis(const std::string& host, int port) : redis_host(host), redis_port(port) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+        io_thread = std::thread(&AsyncRedis::run, this);
+    }
+
+    // Waits up to STOP_TIMEOUT for outstanding replies
+    ~AsyncRedis() {
+        stopping = true;
+        wake();
+        io_thread.join();
+        close(wake_fd);
+        close(epoll_fd);
+    }
+
+    AsyncRedis(const AsyncRedis&) = delete;
+    AsyncRedis& operator=(const AsyncRedis&) = delete;
+
+    bool connected() const {
+        return is_connected.load(std::memory_order_relaxed);
+    }
+
+    // Queues a command for the I/O thread. Thread-safe; the arguments are copied.
+    void command(int argc, const char** argv, const size_t* argvlen, Callback callback) {
+        Command* queued = new Command();
+        int len = redisFormatCommandArgv(&queued->formatted, argc, argv, argvlen);
+        if (len < 0) {
+            queued->formatted = nullptr;
+            delete queued;
+            callback(nullptr);
+            return;
+        }
+        queued->len = len;
+        queued->callback = std::move(callback);
+        queue.push(queued);
+        wake();
+    }
+};
@@ -0,0 +1,667 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <strings.h>
+#include <sys/time.h>
+#include <hiredis/hiredis.h>
+
+struct RedisEndpoint {
+    std::string host;
+    int port = 6379;
+
+    bool operator==(const RedisEndpoint& other) const {
+        return host == other.host && port == other.port;
+    }
+};
+
+// Where the keys of one Redis deployment live: a standalone server, or a Redis
+// Cluster whose slot map is discovered with CLUSTER SLOTS from the seed nodes.
+//
+// A key belongs to slot CRC16(key) % 16384, hashing only the part between the first
+// '{' and the next '}' if there is one, so keys with the same hash tag share a slot
+// and can be used together in one command. The map is updated slot by slot from
+// MOVED redirects and reloaded as a whole by a refresher thread after one, or after
+// a node could not be reached. Shared by every RedisConnection to it.
+class RedisCluster {
+public:
+    static constexpr int SLOTS = 16384;
+
+    // Endpoints as "host:port" entries separated by ','
+    static std::vector<RedisEndpoint> parse_endpoints(const std::string& config) {
+        std::vector<RedisEndpoint> endpoints;
+        std::stringstream entries(config);
+        std::string entry;
+        while (std::getline(entries, entry, ',')) {
+            entry.erase(0, entry.find_first_not_of(" \t"));
+            entry.erase(entry.find_last_not_of(" \t") + 1);
+            if (entry.empty()) {
+                continue;
+            }
+            RedisEndpoint endpoint;
+            if (!parse_address(entry.data(), entry.size(), endpoint)) {
+                std::cerr << "Ignoring invalid Redis endpoint: " << entry << std::endl;
+                continue;
+            }
+            endpoints.push_back(endpoint);
+        }
+        return endpoints;
+    }
+
+    static bool parse_address(const char* address, size_t len, RedisEndpoint& endpoint) {
+        std::string entry(address, len);
+        size_t colon = entry.rfind(':');
+        endpoint.host = entry.substr(0, colon);
+        endpoint.port = 6379;
+        if (colon != std::string::npos) {
+            endpoint.port = atoi(entry.c_str() + colon + 1);
+        }
+        return !endpoint.host.empty() && endpoint.port > 0;
+    }
+
+    static uint16_t key_slot(const char* key, size_t len) {
+        const char* open = static_cast<const char*>(memchr(key, '{', len));
+        if (open) {
+            const char* tag = open + 1;
+            const char* close = static_cast<const char*>(memchr(tag, '}', key + len - tag));
+            if (close && close > tag) {
+                return crc16(tag, close - tag) % SLOTS;
+            }
+        }
+        return crc16(key, len) % SLOTS;
+    }
+
+    // CRC16-CCITT (XMODEM), the checksum Redis Cluster hashes keys with
+    static uint16_t crc16(const char* data, size_t len) {
+        static const std::array<uint16_t, 256> table = [] {
+            std::array<uint16_t, 256> entries{};
+            for (int byte = 0; byte < 256; byte++) {
+                uint16_t crc = byte << 8;
+                for (int bit = 0; bit < 8; bit++) {
+                    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+                }
+                entries[byte] = crc;
+            }
+            return entries;
+        }();
+        uint16_t crc = 0;
+        for (size_t i = 0; i < len; i++) {
+            crc = (crc << 8) ^ table[((crc >> 8) ^ (unsigned char)data[i]) & 0xff];
+        }
+        return crc;
+    }
+
+    // Without cluster mode every key goes to the first seed and redirects are not
+    // expected; in cluster mode the slot map is loaded right away
+    RedisCluster(std::vector<RedisEndpoint> seed_nodes, bool cluster_mode)
+        : seeds(std::move(seed_nodes)), clustered(cluster_mode), slot_node(SLOTS) {
+        if (seeds.empty()) {
+            seeds.push_back(RedisEndpoint{"valkey", 6379});
+        }
+        nodes = seeds;
+        for (auto& node : slot_node) {
+            node.store(0, std::memory_order_relaxed);
+        }
+        if (clustered && !refresh()) {
+            std::cerr << "Could not load the Redis Cluster slot map, starting from " << seeds.front().host << ":"
+                      << seeds.front().port << std::endl;
+            refresh_requested = true;
+        }
+        if (clustered) {
+            refresher = std::thread(&RedisCluster::run_refresher, this);
+        }
+    }
+
+    ~RedisCluster() {
+        {
+            std::lock_guard<std::mutex> lock(refresh_mutex);
+            stopping = true;
+        }
+        refresh_cv.notify_one();
+        if (refresher.joinable()) {
+            refresher.join();
+        }
+    }
+
+    RedisCluster(const RedisCluster&) = delete;
+    RedisCluster& operator=(const RedisCluster&) = delete;
+
+    bool enabled() const {
+        return clustered;
+    }
+
+    const std::vector<RedisEndpoint>& seed_nodes() const {
+        return seeds;
+    }
+
+    size_t slot_owner(uint16_t slot) const {
+        return slot_node[slot].load(std::memory_order_relaxed);
+    }
+
+    RedisEndpoint node(size_t index) {
+        std::lock_guard<std::mutex> lock(nodes_mutex);
+        return nodes[index];
+    }
+
+    // Index of a node in the node table, adding it the first time it is seen.
+    // Indexes stay valid, nodes that left are simply no longer owners of a slot.
+    size_t node_index(const RedisEndpoint& endpoint) {
+        std::lock_guard<std::mutex> lock(nodes_mutex);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (nodes[i] == endpoint) {
+                return i;
+            }
+        }
+        nodes.push_back(endpoint);
+        return nodes.size() - 1;
+    }
+
+    // A MOVED redirect: the slot is served by endpoint from now on
+    size_t moved(uint16_t slot, const RedisEndpoint& endpoint) {
+        size_t index = node_index(endpoint);
+        slot_node[slot].store(index, std::memory_order_relaxed);
+        request_refresh();
+        return index;
+    }
+
+    // Other slots have probably moved as well, or a node went away. The refresher
+    // thread reloads the map, commands are routed with the one at hand meanwhile.
+    void request_refresh() {
+        if (!clustered) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(refresh_mutex);
+            refresh_requested = true;
+        }
+        refresh_cv.notify_one();
+    }
+
+private:
+    static constexpr std::chrono::milliseconds REFRESH_INTERVAL{100};
+
+    std::vector<RedisEndpoint> seeds;
+    bool clustered;
+    std::vector<std::atomic<uint16_t>> slot_node;
+
+    std::mutex nodes_mutex;
+    std::vector<RedisEndpoint> nodes;
+
+    std::mutex refresh_mutex;
+    std::condition_variable refresh_cv;
+    bool refresh_requested = false;
+    bool stopping = false;
+    std::thread refresher;
+
+    // Reloads the slot map when asked to, at most every REFRESH_INTERVAL, and keeps
+    // trying while no node answers. Connecting to a node can take a second, which
+    // is why no request thread waits for this.
+    void run_refresher() {
+        std::unique_lock<std::mutex> lock(refresh_mutex);
+        while (true) {
+            refresh_cv.wait(lock, [this] { return stopping || refresh_requested; });
+            if (stopping) {
+                break;
+            }
+            refresh_requested = false;
+            lock.unlock();
+            bool loaded = refresh();
+            lock.lock();
+            refresh_requested = refresh_requested || !loaded;
+            refresh_cv.wait_for(lock, REFRESH_INTERVAL, [this] { return stopping; });
+        }
+    }
+
+    // Asks the known nodes for CLUSTER SLOTS until one answers
+    bool refresh() {
+        std::vector<RedisEndpoint> candidates;
+        {
+            std::lock_guard<std::mutex> lock(nodes_mutex);
+            candidates = nodes;
+        }
+        struct timeval timeout = {1, 0};
+        for (const RedisEndpoint& candidate : candidates) {
+            redisContext* redis = redisConnectWithTimeout(candidate.host.c_str(), candidate.port, timeout);
+            if (!redis || redis->err) {
+                if (redis) redisFree(redis);
+                continue;
+            }
+            redisReply* reply = (redisReply*)redisCommand(redis, "CLUSTER SLOTS");
+            bool loaded = reply && reply->type == REDIS_REPLY_ARRAY && load_slots(reply, candidate);
+            if (reply) freeReplyObject(reply);
+            redisFree(redis);
+            if (loaded) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Every entry is [first slot, last slot, [host, port, ...] of the master, replicas...];
+    // an empty host means the node that was asked
+    bool load_slots(const redisReply* ranges, const RedisEndpoint& asked) {
+        size_t assigned = 0;
+        for (size_t i = 0; i < ranges->elements; i++) {
+            const redisReply* range = ranges->element[i];
+            if (range->type != REDIS_REPLY_ARRAY || range->elements < 3
+                || range->element[0]->type != REDIS_REPLY_INTEGER || range->element[1]->type != REDIS_REPLY_INTEGER
+                || range->element[2]->type != REDIS_REPLY_ARRAY || range->element[2]->elements < 2) {
+                continue;
+            }
+            const redisReply* master = range->element[2];
+            if (master->element[0]->type != REDIS_REPLY_STRING || master->element[1]->type != REDIS_REPLY_INTEGER) {
+                continue;
+            }
+            RedisEndpoint endpoint{std::string(master->element[0]->str, master->element[0]->len),
+                                   (int)master->element[1]->integer};
+            if (endpoint.host.empty() || endpoint.host == "?") {
+                endpoint.host = asked.host;
+            }
+            size_t index = node_index(endpoint);
+            long long first = std::max(0LL, range->element[0]->integer);
+            long long last = std::min((long long)SLOTS - 1, range->element[1]->integer);
+            for (long long slot = first; slot <= last; slot++) {
+                slot_node[slot].store(index, std::memory_order_relaxed);
+                assigned++;
+            }
+        }
+        return assigned > 0;
+    }
+};
+
+// A blocking connection to a RedisCluster, the drop-in for a redisContext: one
+// hiredis context per node, opened when a command first needs it. Commands are
+// routed by the slot of their key, MOVED and ASK redirects are followed, up to
+// MAX_REDIRECTS times. Pipelined commands (append, then get_reply for each) are
+// grouped per node: every node gets its share in one write before any reply is
+// read, and the replies come back in the order the commands were appended. Replies
+// must be read before the next pipeline starts, whatever is left is discarded.
+// Without cluster mode there is a single node and no key is looked at.
+// Not thread-safe, like the redisContext it replaces.
+class RedisConnection {
+public:
+    RedisConnection(RedisCluster& redis_cluster, std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
+        : cluster(redis_cluster), connect_timeout(timeout) {}
+
+    ~RedisConnection() {
+        discard();
+        for (redisContext* redis : contexts) {
+            if (redis) {
+                redisFree(redis);
+            }
+        }
+    }
+
+    RedisConnection(const RedisConnection&) = delete;
+    RedisConnection& operator=(const RedisConnection&) = delete;
+
+    // Drops broken node connections and whatever was pending, and makes sure the
+    // node of slot 0 (the only node outside cluster mode) can be reached
+    bool connect() {
+        discard();
+        failed = false;
+        for (redisContext*& redis : contexts) {
+            if (redis && redis->err) {
+                redisFree(redis);
+                redis = nullptr;
+            }
+        }
+        return context(cluster.slot_owner(0)) != nullptr;
+    }
+
+    // False once a command failed for lack of a connection, until connect()
+    bool ok() const {
+        return !failed;
+    }
+
+    const char* errstr() const {
+        return last_error.c_str();
+    }
+
+    redisReply* command(const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        redisReply* reply = vcommand(format, args);
+        va_end(args);
+        return reply;
+    }
+
+    redisReply* vcommand(const char* format, va_list args) {
+        char* formatted = nullptr;
+        int len = redisvFormatCommand(&formatted, format, args);
+        if (len < 0) {
+            return nullptr;
+        }
+        discard();
+        redisReply* reply = execute(formatted, len, route(formatted, len), false);
+        redisFreeCommand(formatted);
+        return reply;
+    }
+
+    redisReply* command_argv(int argc, const char** argv, const size_t* argvlen) {
+        char* formatted = nullptr;
+        long long len = redisFormatCommandArgv(&formatted, argc, argv, argvlen);
+        if (len < 0) {
+            return nullptr;
+        }
+        discard();
+        redisReply* reply = execute(formatted, len, route(formatted, len), false);
+        redisFreeCommand(formatted);
+        return reply;
+    }
+
+    void append(const char* format, ...) {
+        char* formatted = nullptr;
+        va_list args;
+        va_start(args, format);
+        int len = redisvFormatCommand(&formatted, format, args);
+        va_end(args);
+        queue(formatted, len);
+    }
+
+    void append_argv(int argc, const char** argv, const size_t* argvlen) {
+        char* formatted = nullptr;
+        long long len = redisFormatCommandArgv(&formatted, argc, argv, argvlen);
+        queue(formatted, len);
+    }
+
+    // The reply to the oldest appended command, REDIS_ERR and no reply if it could
+    // not be sent or its node connection broke
+    int get_reply(redisReply** reply) {
+        if (!queued.empty()) {
+            send_queued();
+        }
+        *reply = nullptr;
+        if (replies.empty()) {
+            return REDIS_ERR;
+        }
+        *reply = replies.front();
+        replies.pop_front();
+        return *reply ? REDIS_OK : REDIS_ERR;
+    }
+
+private:
+    static constexpr int MAX_REDIRECTS = 5;
+    static constexpr size_t NOT_SENT = (size_t)-1;
+
+    struct Queued {
+        char* formatted = nullptr;
+        size_t len = 0;
+        size_t node = 0;
+    };
+
+    RedisCluster& cluster;
+    std::chrono::milliseconds connect_timeout;
+    std::vector<redisContext*> contexts;  // by node index
+    std::vector<Queued> queued;           // appended, not sent yet
+    std::deque<redisReply*> replies;      // read, not taken yet
+    std::string last_error;
+    bool failed = false;
+
+    redisContext* context(size_t node) {
+        if (node >= contexts.size()) {
+            contexts.resize(node + 1, nullptr);
+        }
+        redisContext*& redis = contexts[node];
+        if (redis && !redis->err) {
+            return redis;
+        }
+        if (redis) {
+            redisFree(redis);
+            redis = nullptr;
+        }
+
+        RedisEndpoint endpoint = cluster.node(node);
+        if (connect_timeout.count() > 0) {
+            struct timeval timeout = {(time_t)(connect_timeout.count() / 1000),
+                                      (suseconds_t)(connect_timeout.count() % 1000 * 1000)};
+            redis = redisConnectWithTimeout(endpoint.host.c_str(), endpoint.port, timeout);
+        } else {
+            redis = redisConnect(endpoint.host.c_str(), endpoint.port);
+        }
+        if (!redis || redis->err) {
+            last_error = redis ? redis->errstr : "can't allocate redis context";
+            if (redis) {
+                redisFree(redis);
+                redis = nullptr;
+            }
+            failed = true;
+            cluster.request_refresh();
+            return nullptr;
+        }
+        return redis;
+    }
+
+    // The node serving the first key of a formatted command, *<argc>\r\n followed
+    // by $<len>\r\n<argument>\r\n for every argument
+    size_t route(const char* formatted, size_t len) {
+        if (!cluster.enabled()) {
+            return 0;
+        }
+
+        std::vector<std::pair<const char*, size_t>> args;
+        const char* pos = formatted;
+        const char* end = formatted + len;
+        if (pos == end || *pos != '*') {
+            return cluster.slot_owner(0);
+        }
+        long argc = strtol(pos + 1, nullptr, 10);
+        pos = static_cast<const char*>(memchr(pos, '\n', end - pos));
+        for (long i = 0; pos && i < argc; i++) {
+            pos++;
+            if (pos >= end || *pos != '$') {
+                break;
+            }
+            size_t arg_len = strtoul(pos + 1, nullptr, 10);
+            pos = static_cast<const char*>(memchr(pos, '\n', end - pos));
+            if (!pos || pos + 1 + arg_len + 2 > end) {
+                break;
+            }
+            args.emplace_back(pos + 1, arg_len);
+            pos += arg_len + 2;
+        }
+
+        size_t key = key_index(args);
+        if (key >= args.size()) {
+            return cluster.slot_owner(0);
+        }
+        return cluster.slot_owner(RedisCluster::key_slot(args[key].first, args[key].second));
+    }
+
+    // Position of the first key for the commands whose key is not the first argument
+    static size_t key_index(const std::vector<std::pair<const char*, size_t>>& args) {
+        if (args.empty()) {
+            return 0;
+        }
+        std::string name(args[0].first, args[0].second);
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        if (name == "PING" || name == "INFO" || name == "CLUSTER") {
+            return args.size();
+        }
+        if (name == "LMPOP" || name == "ZMPOP") {
+            return 2;  // numkeys key...
+        }
+        if (name == "BLMPOP" || name == "BZMPOP") {
+            return 3;  // timeout numkeys key...
+        }
+        if (name == "XGROUP" || name == "XINFO") {
+            return 2;  // subcommand key
+        }
+        if (name == "XREAD" || name == "XREADGROUP") {
+            for (size_t i = 1; i < args.size(); i++) {
+                if (args[i].second == 7 && strncasecmp(args[i].first, "STREAMS", 7) == 0) {
+                    return i + 1;
+                }
+            }
+            return args.size();
+        }
+        return 1;
+    }
+
+    // Sends one command to node and follows redirects
+    redisReply* execute(const char* formatted, size_t len, size_t node, bool asking) {
+        static const char ASKING[] = "*1\r\n$6\r\nASKING\r\n";
+        for (int attempt = 0; attempt <= MAX_REDIRECTS; attempt++) {
+            redisContext* redis = context(node);
+            if (!redis) {
+                return nullptr;
+            }
+            if (asking) {
+                redisAppendFormattedCommand(redis, ASKING, sizeof(ASKING) - 1);
+            }
+            redisAppendFormattedCommand(redis, formatted, len);
+            redisReply* reply = nullptr;
+            if (asking && redisGetReply(redis, (void**)&reply) == REDIS_OK && reply) {
+                freeReplyObject(reply);
+                reply = nullptr;
+            }
+            if (redisGetReply(redis, (void**)&reply) != REDIS_OK || !reply) {
+                connection_failed(redis);
+                return nullptr;
+            }
+            if (!redirect(reply, node, asking)) {
+                return reply;
+            }
+            freeReplyObject(reply);
+        }
+        return nullptr;
+    }
+
+    // MOVED <slot> <host>:<port> and ASK <slot> <host>:<port> point at the node to
+    // retry on, TRYAGAIN (a multi-key command during resharding) at the same one
+    bool redirect(const redisReply* reply, size_t& node, bool& asking) {
+        if (!cluster.enabled() || reply->type != REDIS_REPLY_ERROR || !reply->str) {
+            return false;
+        }
+        if (strncmp(reply->str, "TRYAGAIN", 8) == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return true;
+        }
+        bool is_moved = strncmp(reply->str, "MOVED ", 6) == 0;
+        if (!is_moved && strncmp(reply->str, "ASK ", 4) != 0) {
+            return false;
+        }
+        const char* slot = reply->str + (is_moved ? 6 : 4);
+        const char* address = strchr(slot, ' ');
+        RedisEndpoint endpoint;
+        long slot_number = strtol(slot, nullptr, 10);
+        if (!address || slot_number < 0 || slot_number >= RedisCluster::SLOTS
+            || !RedisCluster::parse_address(address + 1, strlen(address + 1), endpoint)) {
+            return false;
+        }
+        if (is_moved) {
+            node = cluster.moved(slot_number, endpoint);
+            asking = false;
+        } else {
+            node = cluster.node_index(endpoint);
+            asking = true;
+        }
+        return true;
+    }
+
+    void connection_failed(redisContext* redis) {
+        last_error = redis->errstr;
+        failed = true;
+        cluster.request_refresh();
+    }
+
+    void queue(char* formatted, long long len) {
+        if (!replies.empty()) {
+            discard();
+        }
+        if (len < 0) {
+            queued.push_back(Queued{nullptr, 0, NOT_SENT});
+            return;
+        }
+        queued.push_back(Queued{formatted, (size_t)len, route(formatted, len)});
+    }
+
+    // Writes every node's commands out before reading any reply, then retries the
+    // redirected ones one by one
+    void send_queued() {
+        std::vector<size_t> used;
+        for (Queued& command : queued) {
+            if (command.node == NOT_SENT) {
+                continue;
+            }
+            redisContext* redis = context(command.node);
+            if (!redis) {
+                command.node = NOT_SENT;
+                continue;
+            }
+            redisAppendFormattedCommand(redis, command.formatted, command.len);
+            if (std::find(used.begin(), used.end(), command.node) == used.end()) {
+                used.push_back(command.node);
+            }
+        }
+        for (size_t node : used) {
+            int done = 0;
+            while (!done && redisBufferWrite(contexts[node], &done) == REDIS_OK) {
+            }
+        }
+
+        // Other replies may still be due on the node a redirect points to
+        struct Redirect {
+            size_t index;
+            size_t node;
+            bool asking;
+        };
+        std::vector<Redirect> redirects;
+        size_t base = replies.size();
+        for (size_t i = 0; i < queued.size(); i++) {
+            redisReply* reply = nullptr;
+            size_t node = queued[i].node;
+            if (node == NOT_SENT) {
+                failed = true;
+            } else if (redisGetReply(contexts[node], (void**)&reply) != REDIS_OK || !reply) {
+                connection_failed(contexts[node]);
+                reply = nullptr;
+            }
+            bool asking = false;
+            if (reply && redirect(reply, node, asking)) {
+                freeReplyObject(reply);
+                reply = nullptr;
+                redirects.push_back(Redirect{i, node, asking});
+            }
+            replies.push_back(reply);
+        }
+        for (const Redirect& retry : redirects) {
+            replies[base + retry.index] = execute(queued[retry.index].formatted, queued[retry.index].len,
+                                                  retry.node, retry.asking);
+        }
+
+        for (Queued& command : queued) {
+            if (command.formatted) {
+                redisFreeCommand(command.formatted);
+            }
+        }
+        queued.clear();
+    }
+
+    void discard() {
+        for (Queued& command : queued) {
+            if (command.formatted) {
+                redisFreeCommand(command.formatted);
+            }
+        }
+        queued.clear();
+        for (redisReply* reply : replies) {
+            if (reply) freeReplyObject(reply);
+        }
+        replies.clear();
+    }
+};
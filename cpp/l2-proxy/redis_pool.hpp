@@ -0,0 +1,142 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <hiredis/hiredis.h>
+#include "redis_cluster.hpp"
+
+// Fixed-size pool of blocking Redis connections shared by the civetweb threads.
+// Connections are opened lazily, PINGed when they have been idle for longer than
+// the health check interval and reconnected when a command on them failed.
+class RedisPool {
+private:
+    struct Connection {
+        std::unique_ptr<RedisConnection> redis;
+        std::chrono::steady_clock::time_point last_used;
+    };
+
+    RedisCluster& cluster;
+    size_t max_size;
+    std::chrono::milliseconds health_check_interval;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Connection*> idle;
+    size_t created = 0;
+
+    // Returns false if the connection could not be (re)established
+    bool ensure_connected(Connection* conn) {
+        if (conn->redis && conn->redis->ok()) {
+            auto idle_for = std::chrono::steady_clock::now() - conn->last_used;
+            if (idle_for < health_check_interval) {
+                return true;
+            }
+            redisReply* reply = conn->redis->command("PING");
+            bool alive = reply && reply->type == REDIS_REPLY_STATUS;
+            if (reply) freeReplyObject(reply);
+            if (alive) {
+                return true;
+            }
+        }
+
+        if (!conn->redis) {
+            conn->redis.reset(new RedisConnection(cluster, std::chrono::milliseconds(1000)));
+        }
+        if (!conn->redis->connect()) {
+            std::cerr << "Redis connection error: " << conn->redis->errstr() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void release(Connection* conn) {
+        conn->last_used = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle.push_back(conn);
+        }
+        cv.notify_one();
+    }
+
+public:
+    // RAII handle, returns the connection to the pool when it goes out of scope
+    class Lease {
+    private:
+        RedisPool* pool = nullptr;
+        Connection* conn = nullptr;
+
+    public:
+        Lease() = default;
+        Lease(RedisPool* p, Connection* c) : pool(p), conn(c) {}
+        Lease(Lease&& other) noexcept : pool(other.pool), conn(other.conn) {
+            other.pool = nullptr;
+            other.conn = nullptr;
+        }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        ~Lease() {
+            if (pool && conn) {
+                pool->release(conn);
+            }
+        }
+
+        RedisConnection* get() const {
+            return conn ? conn->redis.get() : nullptr;
+        }
+
+        RedisConnection* operator->() const {
+            return get();
+        }
+
+        explicit operator bool() const {
+            return conn && conn->redis && conn->redis->ok();
+        }
+    };
+
+    RedisPool(RedisCluster& redis_cluster, size_t size, std::chrono::milliseconds health_check)
+        : cluster(redis_cluster), max_size(size ? size : 1), health_check_interval(health_check) {}
+
+    ~RedisPool() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle.size() != created) {
+            std::cerr << "RedisPool destroyed with " << (created - idle.size()) << " connections in use" << std::endl;
+        }
+        for (Connection* conn : idle) {
+            delete conn;
+        }
+    }
+
+    // Waits up to timeout for a free connection. The lease is empty if none became
+    // available or Redis could not be reached.
+    Lease acquire(std::chrono::milliseconds timeout) {
+        Connection* conn = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (idle.empty() && created < max_size) {
+                created++;
+                conn = new Connection();
+            } else if (cv.wait_for(lock, timeout, [this] { return !idle.empty(); })) {
+                conn = idle.back();
+                idle.pop_back();
+            } else {
+                return Lease();
+            }
+        }
+
+        if (!ensure_connected(conn)) {
+            release(conn);
+            return Lease();
+        }
+        return Lease(this, conn);
+    }
+
+    size_t size() const {
+        return max_size;
+    }
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Time-ordered 128-bit request ids rendered as 32 lowercase hex digits:
+//
+//   | 48 bit unix time ms | 16 bit node id | 16 bit thread slot | 48 bit sequence |
+//
+// Every thread keeps its own slot and sequence, so generating an id is a clock read
+// and a few shifts with no locks, syscalls or allocations. Ids sort by creation time,
+// which keeps Valkey keys roughly ordered and lets consumers read the queue age back
+// out of the id (see timestamp_ms).
+class TimeOrderedIdGenerator {
+public:
+    static constexpr size_t LENGTH = 32;
+
+    static void set_node_id(uint16_t id) {
+        node_id().store(id, std::memory_order_relaxed);
+    }
+
+    // Derives a node id from an instance name such as PROXY_ID (FNV-1a folded to 16 bit)
+    static uint16_t node_id_from_name(const std::string& name) {
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : name) {
+            hash ^= c;
+            hash *= 16777619u;
+        }
+        return static_cast<uint16_t>((hash >> 16) ^ (hash & 0xffff));
+    }
+
+    // Writes exactly LENGTH characters, no terminator
+    static void next(char* out) {
+        thread_local ThreadState state;
+
+        uint64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count();
+        // Never go backwards if the wall clock is adjusted
+        if (now_ms < state.last_ms) {
+            now_ms = state.last_ms;
+        }
+        state.last_ms = now_ms;
+
+        uint64_t high = (now_ms & 0xffffffffffffULL) << 16 | node_id().load(std::memory_order_relaxed);
+        uint64_t low = static_cast<uint64_t>(state.slot) << 48 | (state.sequence++ & 0xffffffffffffULL);
+
+        write_hex(out, high);
+        write_hex(out + 16, low);
+    }
+
+    static std::string next() {
+        char buffer[LENGTH];
+        next(buffer);
+        return std::string(buffer, LENGTH);
+    }
+
+    // Creation time encoded in a time-ordered id, 0 if id is not one
+    static uint64_t timestamp_ms(const std::string& id) {
+        if (id.size() != LENGTH) {
+            return 0;
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < 12; i++) {
+            int digit = hex_value(id[i]);
+            if (digit < 0) {
+                return 0;
+            }
+            value = value << 4 | static_cast<uint64_t>(digit);
+        }
+        return value;
+    }
+
+private:
+    struct ThreadState {
+        uint16_t slot = static_cast<uint16_t>(next_slot().fetch_add(1, std::memory_order_relaxed));
+        uint64_t sequence = 0;
+        uint64_t last_ms = 0;
+    };
+
+    static std::atomic<uint16_t>& node_id() {
+        static std::atomic<uint16_t> id{0};
+        return id;
+    }
+
+    static std::atomic<uint32_t>& next_slot() {
+        static std::atomic<uint32_t> slot{0};
+        return slot;
+    }
+
+    static void write_hex(char* out, uint64_t value) {
+        static const char digits[] = "0123456789abcdef";
+        for (int i = 15; i >= 0; i--) {
+            out[i] = digits[value & 0xf];
+            value >>= 4;
+        }
+    }
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    }
+};
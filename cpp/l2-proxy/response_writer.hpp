@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "CivetServer.h"
+
+// "HTTP/1.1 <code> <reason>\r\n" as a compile-time constant
+template <int Status>
+struct HttpStatusLine;
+
+#define HTTP_STATUS_LINE(code, reason) \
+    template <> \
+    struct HttpStatusLine<code> { \
+        static constexpr char text[] = "HTTP/1.1 " #code " " reason "\r\n"; \
+        static constexpr size_t length = sizeof(text) - 1; \
+    };
+
+HTTP_STATUS_LINE(200, "OK")
+HTTP_STATUS_LINE(201, "Created")
+HTTP_STATUS_LINE(202, "Accepted")
+HTTP_STATUS_LINE(204, "No Content")
+HTTP_STATUS_LINE(400, "Bad Request")
+HTTP_STATUS_LINE(404, "Not Found")
+HTTP_STATUS_LINE(405, "Method Not Allowed")
+HTTP_STATUS_LINE(500, "Internal Server Error")
+HTTP_STATUS_LINE(502, "Bad Gateway")
+HTTP_STATUS_LINE(503, "Service Unavailable")
+HTTP_STATUS_LINE(504, "Gateway Timeout")
+
+#undef HTTP_STATUS_LINE
+
+const char JSON_CONTENT_TYPE[] = "Content-Type: application/json\r\n";
+const char TEXT_CONTENT_TYPE[] = "Content-Type: text/plain\r\n";
+
+// Builds a whole response in a thread-local buffer and sends it with one mg_write.
+// start() leaves HEAD_ROOM bytes in front of the body; the caller appends the body,
+// send() then writes status line, headers and Content-Length into that gap right
+// before the body, so the body is never copied again.
+//
+//     std::string& body = ResponseWriter::start();
+//     body += "{...}";
+//     ResponseWriter::send<200>(conn, JSON_CONTENT_TYPE);
+class ResponseWriter {
+public:
+    static constexpr size_t HEAD_ROOM = 512;
+
+    static std::string& start() {
+        std::string& out = buffer();
+        out.resize(HEAD_ROOM);
+        return out;
+    }
+
+    // headers: complete "Name: value\r\n" lines, without Content-Length.
+    // Returns the number of body bytes sent.
+    template <int Status>
+    static size_t send(struct mg_connection* conn, const char* headers, size_t headers_len) {
+        return finish(conn, HttpStatusLine<Status>::text, HttpStatusLine<Status>::length, headers, headers_len);
+    }
+
+    template <int Status, size_t N>
+    static size_t send(struct mg_connection* conn, const char (&headers)[N]) {
+        return send<Status>(conn, headers, N - 1);
+    }
+
+    // For statuses only known at runtime, e.g. relayed from the worker
+    static size_t send(struct mg_connection* conn, int status_code, const char* headers, size_t headers_len) {
+        switch (status_code) {
+            case 200: return send<200>(conn, headers, headers_len);
+            case 201: return send<201>(conn, headers, headers_len);
+            case 202: return send<202>(conn, headers, headers_len);
+            case 204: return send<204>(conn, headers, headers_len);
+            case 400: return send<400>(conn, headers, headers_len);
+            case 404: return send<404>(conn, headers, headers_len);
+            case 405: return send<405>(conn, headers, headers_len);
+            case 500: return send<500>(conn, headers, headers_len);
+            case 502: return send<502>(conn, headers, headers_len);
+            case 503: return send<503>(conn, headers, headers_len);
+            case 504: return send<504>(conn, headers, headers_len);
+            default: {
+                char status_line[128];
+                int len = snprintf(status_line, sizeof(status_line), "HTTP/1.1 %d %s\r\n",
+                                   status_code, mg_get_response_code_text(conn, status_code));
+                return finish(conn, status_line, (size_t)len, headers, headers_len);
+            }
+        }
+    }
+
+    template <size_t N>
+    static size_t send(struct mg_connection* conn, int status_code, const char (&headers)[N]) {
+        return send(conn, status_code, headers, N - 1);
+    }
+
+private:
+    // Buffers grown by a huge response are not kept around
+    static constexpr size_t MAX_RETAINED_CAPACITY = 4 * 1024 * 1024;
+
+    static std::string& buffer() {
+        thread_local std::string out;
+        return out;
+    }
+
+    static size_t finish(struct mg_connection* conn, const char* status_line, size_t status_len,
+                         const char* headers, size_t headers_len) {
+        std::string& out = buffer();
+        size_t body_len = out.size() - HEAD_ROOM;
+
+        char length_line[48];
+        size_t length_len = snprintf(length_line, sizeof(length_line), "Content-Length: %zu\r\n\r\n", body_len);
+
+        size_t head_len = status_len + headers_len + length_len;
+        if (head_len > HEAD_ROOM) {
+            out.insert(0, head_len - HEAD_ROOM, '\0');
+        }
+        size_t begin = out.size() - body_len - head_len;
+
+        char* head = &out[begin];
+        memcpy(head, status_line, status_len);
+        memcpy(head + status_len, headers, headers_len);
+        memcpy(head + status_len + headers_len, length_line, length_len);
+        mg_write(conn, head, head_len + body_len);
+
+        if (out.capacity() > MAX_RETAINED_CAPACITY) {
+            std::string().swap(out);
+        }
+        return body_len;
+    }
+};
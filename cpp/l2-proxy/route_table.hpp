@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// What the proxy does with a request, decided by method and path prefix.
+//
+// Configured as "METHOD PREFIX ACTION [ARGUMENT]" entries separated by ';', e.g.
+//
+//     POST /api/orders enqueue high; POST /api enqueue; GET / local; * /admin reject 403
+//
+// METHOD may be "*". The longest matching prefix wins, and an exact method beats
+// "*" for the same prefix. Requests no entry matches are rejected with 404.
+//   enqueue  queue the request for the workers and wait for their reply, in the
+//            priority class named by the argument (see PriorityClasses); POST
+//            only, the workers do not answer anything else
+//   local    answer right away from the proxy without touching the queue
+//   reject   answer with STATUS (default 404)
+class RouteTable {
+public:
+    enum class Action {
+        ENQUEUE,
+        LOCAL,
+        REJECT
+    };
+
+    struct Route {
+        std::string method;
+        std::string prefix;
+        Action action = Action::REJECT;
+        int status = 404;
+        std::string priority;  // empty for the default class
+    };
+
+    // Only POST reaches the worker and GET is answered by the proxy, like before
+    // routes; other methods get 405 as they did from civetweb
+    static constexpr const char* DEFAULT_ROUTES = "POST / enqueue; GET / local; * / reject 405";
+
+    explicit RouteTable(const std::string& config) {
+        std::stringstream entries(config);
+        std::string entry;
+        while (std::getline(entries, entry, ';')) {
+            std::stringstream fields(entry);
+            Route route;
+            std::string action;
+            if (!(fields >> route.method >> route.prefix >> action)) {
+                if (entry.find_first_not_of(" \t\r\n") != std::string::npos) {
+                    std::cerr << "Ignoring malformed route: " << entry << std::endl;
+                    ignored++;
+                }
+                continue;
+            }
+            if (action == "enqueue") {
+                if (route.method != "POST") {
+                    std::cerr << "Ignoring enqueue route for a method other than POST: " << entry << std::endl;
+                    ignored++;
+                    continue;
+                }
+                route.action = Action::ENQUEUE;
+                fields >> route.priority;
+            } else if (action == "local") {
+                route.action = Action::LOCAL;
+            } else if (action == "reject") {
+                route.action = Action::REJECT;
+                int status = 0;
+                if (fields >> status && status >= 400 && status < 600) {
+                    route.status = status;
+                }
+            } else {
+                std::cerr << "Ignoring route with unknown action: " << entry << std::endl;
+                ignored++;
+                continue;
+            }
+            routes.push_back(route);
+        }
+
+        std::stable_sort(routes.begin(), routes.end(), [](const Route& a, const Route& b) {
+            if (a.prefix.size() != b.prefix.size()) {
+                return a.prefix.size() > b.prefix.size();
+            }
+            return a.method != "*" && b.method == "*";
+        });
+    }
+
+    const Route& match(const std::string& method, const std::string& path) const {
+        for (const Route& route : routes) {
+            if ((route.method == "*" || route.method == method)
+                && path.compare(0, route.prefix.size(), route.prefix) == 0) {
+                return route;
+            }
+        }
+        return no_route;
+    }
+
+    // Methods that are not rejected for path, for the Allow header of a 405 ("GET, POST")
+    std::string allowed(const std::string& path) const {
+        std::vector<std::string> methods;
+        for (const Route& route : routes) {
+            if (route.method != "*" && match(route.method, path).action != Action::REJECT) {
+                methods.push_back(route.method);
+            }
+        }
+        std::sort(methods.begin(), methods.end());
+        methods.erase(std::unique(methods.begin(), methods.end()), methods.end());
+
+        std::string allow;
+        for (const std::string& method : methods) {
+            if (!allow.empty()) {
+                allow += ", ";
+            }
+            allow += method;
+        }
+        return allow;
+    }
+
+    size_t size() const {
+        return routes.size();
+    }
+
+    // False if any entry had to be ignored, or there was none
+    bool valid() const {
+        return ignored == 0 && !routes.empty();
+    }
+
+private:
+    std::vector<Route> routes;
+    size_t ignored = 0;
+    Route no_route;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <prometheus/counter.h>
+#include "redis_pool.hpp"
+
+// A Redis stats key (stats:redis_writes, ...) that is counted locally. add() is a
+// relaxed increment on a cache-line sized shard picked per thread; StatsFlusher
+// moves the accumulated amount to Redis with one INCRBY.
+class LocalStatsCounter {
+private:
+    static constexpr size_t SHARDS = 16;
+
+    struct alignas(64) Shard {
+        std::atomic<long long> value{0};
+    };
+
+    std::string redis_key;
+    Shard shards[SHARDS];
+
+    static size_t shard_index() {
+        static std::atomic<size_t> next_index{0};
+        thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+        return index;
+    }
+
+public:
+    explicit LocalStatsCounter(const std::string& key) : redis_key(key) {}
+
+    LocalStatsCounter(const LocalStatsCounter&) = delete;
+    LocalStatsCounter& operator=(const LocalStatsCounter&) = delete;
+
+    const std::string& key() const {
+        return redis_key;
+    }
+
+    void add(long long n = 1) {
+        shards[shard_index()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // Counted here but not flushed to Redis yet
+    long long pending() const {
+        long long sum = 0;
+        for (const Shard& shard : shards) {
+            sum += shard.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    long long take() {
+        long long sum = 0;
+        for (Shard& shard : shards) {
+            sum += shard.value.exchange(0, std::memory_order_relaxed);
+        }
+        return sum;
+    }
+};
+
+// Flushes a set of LocalStatsCounters every flush_interval, and once more when it
+// is destroyed. Amounts that fail to reach Redis are added back for the next try.
+class StatsFlusher {
+private:
+    RedisPool& redis_pool;
+    std::vector<LocalStatsCounter*> counters;
+    std::chrono::milliseconds flush_interval;
+    prometheus::Counter& requests_counter;
+    prometheus::Counter& errors_counter;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread flusher;
+
+    void flush() {
+        std::vector<long long> amounts;
+        for (LocalStatsCounter* counter : counters) {
+            amounts.push_back(counter->take());
+        }
+
+        RedisPool::Lease redis = redis_pool.acquire(std::chrono::milliseconds(1000));
+        for (size_t i = 0; i < counters.size(); i++) {
+            if (amounts[i] == 0) {
+                continue;
+            }
+            bool ok = false;
+            if (redis) {
+                redisReply* reply = redis->command("INCRBY %s %lld", counters[i]->key().c_str(), amounts[i]);
+                requests_counter.Increment();
+                ok = reply && reply->type == REDIS_REPLY_INTEGER;
+                if (reply) freeReplyObject(reply);
+            }
+            if (!ok) {
+                errors_counter.Increment();
+                counters[i]->add(amounts[i]);
+            }
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            cv.wait_for(lock, flush_interval, [this] { return stopping; });
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+    }
+
+public:
+    StatsFlusher(RedisPool& pool, std::vector<LocalStatsCounter*> stats, std::chrono::milliseconds interval,
+                 prometheus::Counter& redis_requests, prometheus::Counter& redis_errors)
+        : redis_pool(pool), counters(std::move(stats)), flush_interval(interval),
+          requests_counter(redis_requests), errors_counter(redis_errors) {
+        flusher = std::thread([this] { run(); });
+    }
+
+    ~StatsFlusher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        flusher.join();
+    }
+};
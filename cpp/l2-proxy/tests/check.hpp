@@ -0,0 +1,23 @@
+#pragma once
+
+#include <iostream>
+
+// Minimal assertions for the unit tests. A failed CHECK reports where it failed and
+// the test goes on; main returns check_result() so ctest sees every failure at once.
+inline int& check_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition)                                                                   \
+    do {                                                                                   \
+        if (!(condition)) {                                                                \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed"   \
+                      << std::endl;                                                        \
+            check_failures()++;                                                            \
+        }                                                                                  \
+    } while (0)
+
+inline int check_result() {
+    return check_failures() == 0 ? 0 : 1;
+}
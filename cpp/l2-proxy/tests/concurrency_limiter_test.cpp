@@ -0,0 +1,104 @@
+#include <chrono>
+#include <thread>
+#include <prometheus/gauge.h>
+#include "check.hpp"
+#include "concurrency_limiter.hpp"
+
+using std::chrono::microseconds;
+
+// Fills every slot, then lets all the calls finish in time
+static void full_round(AimdLimiter& limiter, microseconds latency) {
+    int taken = 0;
+    while (limiter.try_acquire()) {
+        taken++;
+    }
+    for (int i = 0; i < taken; i++) {
+        limiter.release(latency, true);
+    }
+}
+
+// One call at a time, which leaves the limit unused
+static void single_call(AimdLimiter& limiter, microseconds latency, bool ok) {
+    if (limiter.try_acquire()) {
+        limiter.release(latency, ok);
+    }
+}
+
+int main() {
+    // The initial limit is kept within the bounds, the minimum is at least one
+    prometheus::Gauge clamped_gauge;
+    AimdLimiter clamped(50, 2, 10, clamped_gauge);
+    CHECK(clamped.get() == 10);
+    CHECK(clamped_gauge.Value() == 10);
+    prometheus::Gauge floor_gauge;
+    AimdLimiter floor(0, 0, 10, floor_gauge);
+    CHECK(floor.get() == 1);
+
+    // Slots run out at the limit and come back on cancel
+    prometheus::Gauge slots_gauge;
+    AimdLimiter slots(3, 1, 10, slots_gauge);
+    CHECK(slots.try_acquire());
+    CHECK(slots.try_acquire());
+    CHECK(slots.try_acquire());
+    CHECK(!slots.try_acquire());
+    slots.cancel();
+    CHECK(slots.try_acquire());
+
+    // Calls that finish in time raise a limit that is used, up to the maximum
+    prometheus::Gauge growth_gauge;
+    AimdLimiter growth(4, 1, 20, growth_gauge);
+    for (int round = 0; round < 3; round++) {
+        full_round(growth, microseconds(1000));
+    }
+    CHECK(growth.get() > 4);
+    CHECK(growth.get() < 20);
+    for (int round = 0; round < 100; round++) {
+        full_round(growth, microseconds(1000));
+    }
+    CHECK(growth.get() == 20);
+    CHECK(growth_gauge.Value() == 20);
+
+    // A limit that is mostly idle does not grow
+    prometheus::Gauge idle_gauge;
+    AimdLimiter idle(10, 1, 20, idle_gauge);
+    for (int i = 0; i < 100; i++) {
+        single_call(idle, microseconds(1000), true);
+    }
+    CHECK(idle.get() == 10);
+
+    // An error cuts the limit, once per cooldown
+    prometheus::Gauge error_gauge;
+    AimdLimiter errors(20, 1, 20, error_gauge);
+    single_call(errors, microseconds(1000), false);
+    CHECK(errors.get() == 18);
+    CHECK(error_gauge.Value() == 18);
+    single_call(errors, microseconds(1000), false);
+    CHECK(errors.get() == 18);
+    std::this_thread::sleep_for(std::chrono::milliseconds(15));
+    single_call(errors, microseconds(1000), false);
+    CHECK(errors.get() == 16);
+
+    // A latency spike against the long-term average is congestion, a single
+    // slow call among many fast ones is not
+    prometheus::Gauge spike_gauge;
+    AimdLimiter spike(10, 1, 20, spike_gauge);
+    for (int i = 0; i < 200; i++) {
+        single_call(spike, microseconds(1000), true);
+    }
+    single_call(spike, microseconds(2500), true);
+    CHECK(spike.get() == 10);
+    single_call(spike, microseconds(100000), true);
+    CHECK(spike.get() == 9);
+
+    // Cuts stop at the minimum
+    prometheus::Gauge bottom_gauge;
+    AimdLimiter bottom(10, 5, 20, bottom_gauge);
+    for (int i = 0; i < 10; i++) {
+        single_call(bottom, microseconds(1000), false);
+        std::this_thread::sleep_for(std::chrono::milliseconds(11));
+    }
+    CHECK(bottom.get() == 5);
+    CHECK(bottom_gauge.Value() == 5);
+
+    return check_result();
+}
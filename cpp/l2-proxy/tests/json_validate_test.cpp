@@ -0,0 +1,81 @@
+#include <cstring>
+#include <string>
+#include "check.hpp"
+#include "json_validate.hpp"
+
+static bool valid(const std::string& text) {
+    return JsonValidator::valid(text.data(), text.size());
+}
+
+int main() {
+    // Scalars and surrounding whitespace
+    CHECK(valid("null"));
+    CHECK(valid("true"));
+    CHECK(valid("false"));
+    CHECK(valid(" \t\r\n42 \n"));
+    CHECK(valid("\"text\""));
+    CHECK(!valid(""));
+    CHECK(!valid("   "));
+    CHECK(!valid("nul"));
+    CHECK(!valid("True"));
+
+    // Numbers
+    CHECK(valid("0"));
+    CHECK(valid("-0"));
+    CHECK(valid("-12.5e+3"));
+    CHECK(valid("1E-7"));
+    CHECK(!valid("01"));
+    CHECK(!valid("-"));
+    CHECK(!valid("1."));
+    CHECK(!valid(".5"));
+    CHECK(!valid("1e"));
+    CHECK(!valid("+1"));
+
+    // Strings
+    CHECK(valid("\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\""));
+    CHECK(valid("\"\\u00e9\\uABCD\""));
+    CHECK(!valid("\"\\u12g4\""));
+    CHECK(!valid("\"\\u12\""));
+    CHECK(!valid("\"\\x\""));
+    CHECK(valid("\"\\ud83d\\ude00\""));
+    CHECK(valid("\"\\uDBFF\\uDFFF\""));
+    CHECK(!valid("\"\\ud800\""));
+    CHECK(!valid("\"\\ud800x\""));
+    CHECK(!valid("\"\\ud800\\n\""));
+    CHECK(!valid("\"\\ud800\\u0041\""));
+    CHECK(!valid("\"\\ud800\\ud800\""));
+    CHECK(!valid("\"\\udc00\""));
+    CHECK(!valid("\"unterminated"));
+    CHECK(!valid("\"tab\there\""));
+    CHECK(valid("\"\xc3\xa9\""));
+
+    // Objects and arrays
+    CHECK(valid("{}"));
+    CHECK(valid("[]"));
+    CHECK(valid("{ \"a\" : [1, 2, {\"b\": null}], \"c\": \"d\" }"));
+    CHECK(!valid("{\"a\" 1}"));
+    CHECK(!valid("{\"a\": 1,}"));
+    CHECK(!valid("[1, 2,]"));
+    CHECK(!valid("[1 2]"));
+    CHECK(!valid("{a: 1}"));
+    CHECK(!valid("{\"a\": 1"));
+    CHECK(!valid("[1"));
+
+    // Exactly one value
+    CHECK(!valid("{} {}"));
+    CHECK(!valid("1 2"));
+    CHECK(!valid("[] x"));
+
+    // Only len bytes are looked at
+    const char* padded = "[1]garbage";
+    CHECK(JsonValidator::valid(padded, 3));
+    CHECK(!JsonValidator::valid(padded, strlen(padded)));
+    CHECK(!JsonValidator::valid("true", 3));
+
+    // Nesting up to the limit is fine, deeper is rejected
+    CHECK(valid(std::string(256, '[') + std::string(256, ']')));
+    CHECK(!valid(std::string(300, '[') + std::string(300, ']')));
+    CHECK(!valid(std::string(100000, '[')));
+
+    return check_result();
+}
@@ -0,0 +1,97 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "check.hpp"
+#include "mpsc_queue.hpp"
+
+struct Node {
+    std::atomic<Node*> next{nullptr};
+    int producer = 0;
+    int sequence = 0;
+};
+
+int main() {
+    // FIFO from a single producer, empty again once drained
+    {
+        MpscQueue<Node> queue;
+        CHECK(queue.empty());
+        CHECK(queue.pop() == nullptr);
+        Node nodes[3];
+        for (int i = 0; i < 3; i++) {
+            nodes[i].sequence = i;
+            queue.push(&nodes[i]);
+        }
+        CHECK(!queue.empty());
+        for (int i = 0; i < 3; i++) {
+            Node* node = queue.pop();
+            CHECK(node == &nodes[i]);
+        }
+        CHECK(queue.pop() == nullptr);
+        CHECK(queue.empty());
+
+        // Nodes can be pushed again after they were popped, also one at a time
+        for (int round = 0; round < 3; round++) {
+            queue.push(&nodes[round]);
+            CHECK(queue.pop() == &nodes[round]);
+            CHECK(queue.pop() == nullptr);
+        }
+        queue.push(&nodes[2]);
+        queue.push(&nodes[0]);
+        CHECK(queue.pop() == &nodes[2]);
+        queue.push(&nodes[1]);
+        CHECK(queue.pop() == &nodes[0]);
+        CHECK(queue.pop() == &nodes[1]);
+        CHECK(queue.pop() == nullptr);
+    }
+
+    // Many producers: every node arrives once, in order per producer
+    {
+        const int PRODUCERS = 4;
+        const int PER_PRODUCER = 100000;
+        MpscQueue<Node> queue;
+        std::vector<std::vector<Node>> nodes(PRODUCERS);
+        for (auto& producer_nodes : nodes) {
+            producer_nodes = std::vector<Node>(PER_PRODUCER);
+        }
+        std::atomic<bool> go{false};
+        std::vector<std::thread> producers;
+        for (int p = 0; p < PRODUCERS; p++) {
+            producers.emplace_back([&, p] {
+                while (!go.load()) {
+                    std::this_thread::yield();
+                }
+                for (int i = 0; i < PER_PRODUCER; i++) {
+                    nodes[p][i].producer = p;
+                    nodes[p][i].sequence = i;
+                    queue.push(&nodes[p][i]);
+                }
+            });
+        }
+        go.store(true);
+
+        std::vector<int> expected(PRODUCERS, 0);
+        bool in_order = true;
+        int received = 0;
+        while (received < PRODUCERS * PER_PRODUCER) {
+            Node* node = queue.pop();
+            if (!node) {
+                std::this_thread::yield();
+                continue;
+            }
+            in_order = in_order && node->sequence == expected[node->producer];
+            expected[node->producer] = node->sequence + 1;
+            received++;
+        }
+        for (std::thread& producer : producers) {
+            producer.join();
+        }
+        CHECK(in_order);
+        for (int p = 0; p < PRODUCERS; p++) {
+            CHECK(expected[p] == PER_PRODUCER);
+        }
+        CHECK(queue.pop() == nullptr);
+        CHECK(queue.empty());
+    }
+
+    return check_result();
+}
@@ -0,0 +1,128 @@
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "check.hpp"
+#include "priority_queue.hpp"
+
+static bool same(const std::vector<size_t>& order, const std::vector<size_t>& expected) {
+    return order == expected;
+}
+
+int main() {
+    // Classes in order of precedence, each on a list of its own
+    PriorityClasses classes("high:8, normal:4 ,low:1", "normal");
+    CHECK(classes.size() == 3);
+    CHECK(classes[0].name == "high");
+    CHECK(classes[0].key == "http:requests:high");
+    CHECK(classes[0].weight == 8);
+    CHECK(classes[1].weight == 4);
+    CHECK(classes[2].key == "http:requests:low");
+    CHECK(classes.default_index() == 1);
+    CHECK(classes.requeue_key() == "http:requests:high");
+    CHECK(classes.find("low") == 2);
+    CHECK(classes.find("none") == -1);
+    std::string low_key = "http:requests:low";
+    CHECK(classes.find_key(low_key.data(), low_key.size()) == 2);
+    CHECK(classes.find_key(low_key.data(), low_key.size() - 1) == -1);
+
+    // With the streams transport every class is a stream next to its list
+    CHECK(classes[0].stream_key == "http:requests:high:stream");
+    std::string normal_stream = "http:requests:normal:stream";
+    CHECK(classes.find_stream_key(normal_stream.data(), normal_stream.size()) == 1);
+    CHECK(classes.find_stream_key(low_key.data(), low_key.size()) == -1);
+    CHECK(classes.find_key(normal_stream.data(), normal_stream.size()) == -1);
+
+    // An unknown default name falls back to the last class, a missing weight is 1
+    PriorityClasses fallback("a,b:2", "c");
+    CHECK(fallback[0].weight == 1);
+    CHECK(fallback.default_index() == 1);
+
+    // Invalid entries are skipped, without any valid one there is the single old list
+    PriorityClasses invalid("dead:2,:3,x:0,y:-1,z:1,z:2", "");
+    CHECK(invalid.size() == 1);
+    CHECK(invalid[0].name == "z");
+    CHECK(invalid[0].weight == 1);
+    PriorityClasses single("", "");
+    CHECK(single.size() == 1);
+    CHECK(single[0].name == "default");
+    CHECK(single[0].key == "http:requests");
+    CHECK(single[0].stream_key == "http:requests:stream");
+    CHECK(single.default_index() == 0);
+
+    // While every class has work, fetches are shared by weight and interleaved
+    {
+        WeightedFairScheduler scheduler(classes, std::chrono::hours(1));
+        std::vector<int> served(classes.size(), 0);
+        int longest_wait = 0;
+        int since_low = 0;
+        for (int round = 0; round < 13 * 100; round++) {
+            size_t next = scheduler.order().front();
+            scheduler.served(next);
+            served[next]++;
+            since_low = next == 2 ? 0 : since_low + 1;
+            longest_wait = std::max(longest_wait, since_low);
+        }
+        CHECK(served[0] == 800);
+        CHECK(served[1] == 400);
+        CHECK(served[2] == 100);
+        CHECK(longest_wait < 13);
+    }
+
+    // Idle classes cost nothing: the busy ones share the fetches by their weights
+    {
+        WeightedFairScheduler scheduler(classes, std::chrono::hours(1));
+        std::vector<int> served(classes.size(), 0);
+        for (int round = 0; round < 1000; round++) {
+            // high is empty, so the first class after it in the order is served
+            const std::vector<size_t>& order = scheduler.order();
+            size_t next = order[0] == 0 ? order[1] : order[0];
+            scheduler.served(next);
+            served[next]++;
+        }
+        CHECK(served[0] == 0);
+        CHECK(served[1] >= 790 && served[1] <= 810);
+        CHECK(served[2] >= 190 && served[2] <= 210);
+    }
+
+    // Credit is capped, a class idle for long does not get a long run afterwards
+    {
+        WeightedFairScheduler scheduler(classes, std::chrono::hours(1));
+        for (int round = 0; round < 1000; round++) {
+            const std::vector<size_t>& order = scheduler.order();
+            size_t next = order[0] == 0 ? order[1] : order[0];
+            scheduler.served(next);
+        }
+        int high = 0;
+        for (int round = 0; round < 13; round++) {
+            size_t next = scheduler.order().front();
+            scheduler.served(next);
+            high += next == 0;
+        }
+        CHECK(high <= 9);
+    }
+
+    // A class not served for max_wait goes first regardless of credit
+    {
+        WeightedFairScheduler scheduler(classes, std::chrono::milliseconds(20));
+        for (int round = 0; round < 10; round++) {
+            scheduler.served(0);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        scheduler.served(0);
+        size_t next = scheduler.order().front();
+        CHECK(next != 0);
+        scheduler.served(next);
+        CHECK(scheduler.order().front() == 3 - next);
+    }
+
+    // A single class is always first
+    {
+        WeightedFairScheduler scheduler(single, std::chrono::milliseconds(0));
+        CHECK(same(scheduler.order(), {0}));
+        scheduler.served(0);
+        CHECK(same(scheduler.order(), {0}));
+    }
+
+    return check_result();
+}
@@ -0,0 +1,50 @@
+#include <cstring>
+#include <string>
+#include "check.hpp"
+#include "redis_cluster.hpp"
+
+static uint16_t slot(const std::string& key) {
+    return RedisCluster::key_slot(key.data(), key.size());
+}
+
+int main() {
+    // CRC16-CCITT (XMODEM) check value and slots as Redis computes them
+    CHECK(RedisCluster::crc16("123456789", 9) == 0x31c3);
+    CHECK(RedisCluster::crc16("", 0) == 0);
+    CHECK(slot("123456789") == 12739);
+    CHECK(slot("foo") == 12182);
+    CHECK(slot("bar") == 5061);
+    CHECK(slot("user1000") == 3443);
+
+    // Only the hash tag is hashed, so tagged keys share a slot
+    CHECK(slot("{user1000}.following") == 3443);
+    CHECK(slot("{user1000}.followers") == 3443);
+    CHECK(slot("http:requests:{0}") == slot("0"));
+    CHECK(slot("http:requests:high:{0}:stream") == slot("http:requests:high:{0}"));
+    CHECK(slot("foo{bar}{zap}") == slot("bar"));
+    CHECK(slot("foo{{bar}}zap") == slot("{bar"));
+
+    // An empty or unterminated tag hashes the whole key
+    CHECK(slot("foo{}{bar}") == 8363);
+    CHECK(slot("{}") == 15257);
+    CHECK(slot("{bar") == 4015);
+
+    // Only len bytes count, keys may contain NUL
+    CHECK(RedisCluster::key_slot("foobar", 3) == 12182);
+    CHECK(RedisCluster::key_slot("{a}b", 2) == RedisCluster::key_slot("{a", 2));
+    std::string binary("a\0b", 3);
+    CHECK(slot(binary) == RedisCluster::crc16(binary.data(), 3) % RedisCluster::SLOTS);
+    CHECK(slot(binary) != slot("a"));
+
+    // Endpoints
+    std::vector<RedisEndpoint> endpoints = RedisCluster::parse_endpoints(" valkey-1:7000, valkey-2 ,,:7001,10.0.0.3:0");
+    CHECK(endpoints.size() == 2);
+    CHECK(endpoints.size() == 2 && endpoints[0].host == "valkey-1" && endpoints[0].port == 7000);
+    CHECK(endpoints.size() == 2 && endpoints[1].host == "valkey-2" && endpoints[1].port == 6379);
+    RedisEndpoint endpoint;
+    const char* address = "10.0.0.1:6380";
+    CHECK(RedisCluster::parse_address(address, strlen(address), endpoint));
+    CHECK(endpoint.host == "10.0.0.1" && endpoint.port == 6380);
+
+    return check_result();
+}
@@ -0,0 +1,86 @@
+#include <chrono>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "check.hpp"
+#include "request_id.hpp"
+
+static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+    ).count();
+}
+
+static bool lower_hex(const std::string& id) {
+    return id.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+int main() {
+    TimeOrderedIdGenerator::set_node_id(0xbeef);
+
+    // 32 lowercase hex digits: time, node id, thread slot, sequence
+    uint64_t before = now_ms();
+    std::string id = TimeOrderedIdGenerator::next();
+    uint64_t after = now_ms();
+    CHECK(id.size() == TimeOrderedIdGenerator::LENGTH);
+    CHECK(lower_hex(id));
+    CHECK(id.substr(12, 4) == "beef");
+    CHECK(TimeOrderedIdGenerator::timestamp_ms(id) >= before);
+    CHECK(TimeOrderedIdGenerator::timestamp_ms(id) <= after);
+
+    // The raw form writes exactly LENGTH characters
+    char buffer[TimeOrderedIdGenerator::LENGTH + 1];
+    buffer[TimeOrderedIdGenerator::LENGTH] = '!';
+    TimeOrderedIdGenerator::next(buffer);
+    CHECK(buffer[TimeOrderedIdGenerator::LENGTH] == '!');
+    CHECK(std::string(buffer, TimeOrderedIdGenerator::LENGTH) > id);
+
+    // Ids of one thread sort in the order they were made, across milliseconds too
+    std::string previous = TimeOrderedIdGenerator::next();
+    bool ordered = true;
+    for (int i = 0; i < 100000; i++) {
+        std::string current = TimeOrderedIdGenerator::next();
+        ordered = ordered && current > previous;
+        previous = current;
+    }
+    CHECK(ordered);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    std::string later = TimeOrderedIdGenerator::next();
+    CHECK(later > previous);
+    CHECK(TimeOrderedIdGenerator::timestamp_ms(later) > TimeOrderedIdGenerator::timestamp_ms(id));
+
+    // Threads get slots of their own, so their ids never collide
+    const int THREADS = 8;
+    const int PER_THREAD = 10000;
+    std::vector<std::vector<std::string>> ids(THREADS);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([&ids, t] {
+            for (int i = 0; i < PER_THREAD; i++) {
+                ids[t].push_back(TimeOrderedIdGenerator::next());
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    std::set<std::string> unique;
+    for (const std::vector<std::string>& thread_ids : ids) {
+        unique.insert(thread_ids.begin(), thread_ids.end());
+    }
+    CHECK(unique.size() == THREADS * PER_THREAD);
+
+    // Node ids derived from names are stable and tell instances apart
+    CHECK(TimeOrderedIdGenerator::node_id_from_name("proxy-1") == TimeOrderedIdGenerator::node_id_from_name("proxy-1"));
+    CHECK(TimeOrderedIdGenerator::node_id_from_name("proxy-1") != TimeOrderedIdGenerator::node_id_from_name("proxy-2"));
+
+    // Anything else has no timestamp
+    CHECK(TimeOrderedIdGenerator::timestamp_ms("") == 0);
+    CHECK(TimeOrderedIdGenerator::timestamp_ms(id.substr(1)) == 0);
+    CHECK(TimeOrderedIdGenerator::timestamp_ms("550e8400-e29b-41d4-a716-446655440000") == 0);
+    CHECK(TimeOrderedIdGenerator::timestamp_ms("0000000003E8" + id.substr(12)) == 0);
+    CHECK(TimeOrderedIdGenerator::timestamp_ms("0000000003e8" + id.substr(12)) == 1000);
+
+    return check_result();
+}
@@ -0,0 +1,64 @@
+#include <string>
+#include <vector>
+#include "check.hpp"
+#include "response_writer.hpp"
+
+// civetweb is not linked: every mg_write is recorded instead of sent
+static std::vector<std::string> writes;
+
+int mg_write(struct mg_connection*, const void* buf, size_t len) {
+    writes.emplace_back(static_cast<const char*>(buf), len);
+    return (int)len;
+}
+
+const char* mg_get_response_code_text(const struct mg_connection*, int response_code) {
+    return response_code == 418 ? "I'm a teapot" : "Unknown";
+}
+
+static struct mg_connection* const conn = nullptr;
+
+int main() {
+    // Status line, headers, Content-Length and body go out in a single write
+    std::string& body = ResponseWriter::start();
+    body += "{\"ok\":true}";
+    CHECK(ResponseWriter::send<200>(conn, JSON_CONTENT_TYPE) == 11);
+    CHECK(writes.size() == 1);
+    CHECK(writes.back() == "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: application/json\r\n"
+                           "Content-Length: 11\r\n"
+                           "\r\n"
+                           "{\"ok\":true}");
+
+    // An empty body still ends the headers
+    ResponseWriter::start();
+    CHECK(ResponseWriter::send<204>(conn, TEXT_CONTENT_TYPE) == 0);
+    CHECK(writes.size() == 2);
+    CHECK(writes.back() == "HTTP/1.1 204 No Content\r\nContent-Type: text/plain\r\nContent-Length: 0\r\n\r\n");
+
+    // Statuses known at runtime, with and without a constant status line
+    ResponseWriter::start() += "x";
+    std::string headers = std::string("Allow: GET, POST\r\n") + JSON_CONTENT_TYPE;
+    ResponseWriter::send(conn, 405, headers.data(), headers.size());
+    CHECK(writes.back() == "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, POST\r\n"
+                           "Content-Type: application/json\r\nContent-Length: 1\r\n\r\nx");
+    ResponseWriter::start() += "tea";
+    ResponseWriter::send(conn, 418, TEXT_CONTENT_TYPE);
+    CHECK(writes.back() == "HTTP/1.1 418 I'm a teapot\r\nContent-Type: text/plain\r\nContent-Length: 3\r\n\r\ntea");
+
+    // Headers longer than the head room are still sent in front of the body
+    std::string long_headers = "X-Long: " + std::string(ResponseWriter::HEAD_ROOM, 'h') + "\r\n";
+    ResponseWriter::start() += "body";
+    ResponseWriter::send<200>(conn, long_headers.data(), long_headers.size());
+    CHECK(writes.size() == 5);
+    CHECK(writes.back() == "HTTP/1.1 200 OK\r\n" + long_headers + "Content-Length: 4\r\n\r\nbody");
+
+    // A large body is counted in full
+    std::string& large = ResponseWriter::start();
+    large.append(1 << 20, 'b');
+    CHECK(ResponseWriter::send<200>(conn, TEXT_CONTENT_TYPE) == (1 << 20));
+    const std::string& sent = writes.back();
+    CHECK(sent.find("Content-Length: 1048576\r\n\r\n") != std::string::npos);
+    CHECK(sent.size() == sent.find("\r\n\r\n") + 4 + (1 << 20));
+
+    return check_result();
+}
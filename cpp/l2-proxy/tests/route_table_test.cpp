@@ -0,0 +1,70 @@
+#include <string>
+#include "check.hpp"
+#include "route_table.hpp"
+
+using Action = RouteTable::Action;
+
+int main() {
+    // The default table: POST is queued, GET answered locally, anything else 405
+    RouteTable defaults(RouteTable::DEFAULT_ROUTES);
+    CHECK(defaults.valid());
+    CHECK(defaults.size() == 3);
+    CHECK(defaults.match("POST", "/api/orders").action == Action::ENQUEUE);
+    CHECK(defaults.match("POST", "/api/orders").priority.empty());
+    CHECK(defaults.match("GET", "/").action == Action::LOCAL);
+    CHECK(defaults.match("PUT", "/api").action == Action::REJECT);
+    CHECK(defaults.match("PUT", "/api").status == 405);
+    CHECK(defaults.match("DELETE", "/").status == 405);
+    CHECK(defaults.allowed("/api") == "GET, POST");
+
+    // Longest prefix wins, an exact method beats "*" for the same prefix
+    RouteTable routes("POST /api/orders enqueue high; POST /api enqueue; * /api reject 403; GET /api local;"
+                      " * /admin reject 403; GET / local");
+    CHECK(routes.valid());
+    CHECK(routes.size() == 6);
+    CHECK(routes.match("POST", "/api/orders/7").action == Action::ENQUEUE);
+    CHECK(routes.match("POST", "/api/orders/7").priority == "high");
+    CHECK(routes.match("POST", "/api/users").action == Action::ENQUEUE);
+    CHECK(routes.match("POST", "/api/users").priority.empty());
+    CHECK(routes.match("GET", "/api/users").action == Action::LOCAL);
+    CHECK(routes.match("PUT", "/api/users").action == Action::REJECT);
+    CHECK(routes.match("PUT", "/api/users").status == 403);
+    CHECK(routes.match("GET", "/admin").status == 403);
+    CHECK(routes.match("GET", "/index.html").action == Action::LOCAL);
+
+    // Allow lists the methods that get past the table for that path
+    CHECK(routes.allowed("/api/orders") == "GET, POST");
+    CHECK(routes.allowed("/admin") == "");
+    CHECK(routes.allowed("/index.html") == "GET");
+
+    // Prefixes match on characters, not path segments
+    CHECK(routes.match("POST", "/apiary").action == Action::ENQUEUE);
+
+    // No match is a 404
+    CHECK(routes.match("POST", "/").action == Action::REJECT);
+    CHECK(routes.match("POST", "/").status == 404);
+    CHECK(RouteTable("GET /static local").match("GET", "/other").status == 404);
+
+    // Reject status defaults to 404 and must be an error status
+    RouteTable statuses("* /a reject; * /b reject 200; * /c reject 503");
+    CHECK(statuses.valid());
+    CHECK(statuses.match("GET", "/a").status == 404);
+    CHECK(statuses.match("GET", "/b").status == 404);
+    CHECK(statuses.match("GET", "/c").status == 503);
+
+    // Only POST can be queued, anything else is refused and the table is invalid
+    RouteTable get_enqueue("GET /api enqueue; POST / enqueue");
+    CHECK(!get_enqueue.valid());
+    CHECK(get_enqueue.size() == 1);
+    CHECK(get_enqueue.match("GET", "/api").status == 404);
+    CHECK(!RouteTable("* / enqueue").valid());
+
+    // Malformed entries and unknown actions make the table invalid, empty entries do not
+    CHECK(RouteTable("POST / enqueue;; ;").valid());
+    CHECK(!RouteTable("POST /").valid());
+    CHECK(!RouteTable("POST / forward").valid());
+    CHECK(!RouteTable("").valid());
+    CHECK(!RouteTable(" ; ").valid());
+
+    return check_result();
+}
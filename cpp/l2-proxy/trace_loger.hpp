@@ -5,6 +5,7 @@
 #include <curl/curl.h>
 #include <iostream>
 #include "nlohmann/json.hpp"
+#include "async_logger.hpp"
 
 #ifdef USE_OPENTELEMETRY
 class TraceLogger {
@@ -39,7 +40,7 @@ public:
     ) {
         CURL* curl = curl_easy_init();
         if (!curl) {
-            std::cerr << "Failed to initialize curl for trace send\n";
+            LOG_ERROR("Failed to initialize curl for trace send");
             return;
         }
 
@@ -76,13 +77,13 @@ public:
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload_str.c_str());
         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(payload_str.size()));
 
-        std::cout << " TraceLoger-body:" << payload_str << std::endl;
+        LOG_SAMPLED(LogLevel::DEBUG, "TraceLoger-body: %.*s",
+                    AsyncLogger::instance().body_preview(payload_str.size()), payload_str.c_str());
 
         // Выполняем запрос
         CURLcode res = curl_easy_perform(curl);
         if (res != CURLE_OK) {
-            std::cerr << "Trace send failed: " << curl_easy_strerror(res)
-                      << " (" << oo_trace_url << ")\n";
+            LOG_ERROR("Trace send failed: %s (%s)", curl_easy_strerror(res), oo_trace_url.c_str());
         }
 
         // Освобождаем заголовки
@@ -184,7 +185,7 @@ public:
     ) {
         CURL* curl = curl_easy_init();
         if (!curl) {
-            std::cerr << "Failed to initialize curl for jaeger trace send\n";
+            LOG_ERROR("Failed to initialize curl for jaeger trace send");
             return;
         }
 
@@ -229,13 +230,13 @@ public:
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload_str.c_str());
         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(payload_str.size()));
 
-        std::cout << " JaegerLogger-body:" << payload_str << std::endl;
+        LOG_SAMPLED(LogLevel::DEBUG, "JaegerLogger-body: %.*s",
+                    AsyncLogger::instance().body_preview(payload_str.size()), payload_str.c_str());
 
         // Выполняем запрос
         CURLcode res = curl_easy_perform(curl);
         if (res != CURLE_OK) {
-            std::cerr << "Jaeger trace send failed: " << curl_easy_strerror(res)
-                      << " (" << jaeger_url << ")\n";
+            LOG_ERROR("Jaeger trace send failed: %s (%s)", curl_easy_strerror(res), jaeger_url.c_str());
         }
 
         // Освобождаем заголовки